@@ -1,7 +1,49 @@
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include "meta.h"
 
+// produce an individually-mmapped allocation whose group header sits
+// at the start of the page preceding an aligned address, trimming the
+// excess mapped to find such an address rather than keeping it.
+static void *map_aligned(size_t align, size_t len, size_t pagesize)
+{
+	size_t needed = pagesize + len + IB;
+	needed += -needed & (pagesize-1);
+	size_t extra = align - pagesize;
+	if (exceeds_limit(needed)) return 0;
+	unsigned char *map = mem_map(needed + extra);
+	if (map==MAP_FAILED) return 0;
+	unsigned char *mem = map + (-(uintptr_t)(map + pagesize) & (align-1));
+	if (mem != map) mem_unmap(map, mem-map);
+	if (mem != map+extra) mem_unmap(mem+needed, map+extra-mem);
+
+	wrlock();
+	step_seq();
+	struct meta *g = alloc_meta();
+	if (!g) {
+		unlock();
+		mem_unmap(mem, needed);
+		return 0;
+	}
+	g->mem = (void *)mem;
+	g->mem->meta = g;
+	g->last_idx = 0;
+	g->freeable = 1;
+	g->sizeclass = 63;
+	g->maplen = needed/4096;
+	ctx.mapped += needed;
+	g->avail_mask = g->freed_mask = 0;
+	pagemap_set(mem, needed, g);
+	PROBE2(large_mmap, mem, needed);
+	ctx.mmap_counter++;
+	unlock();
+
+	// enframe at offset zero; the caller moves it to the aligned
+	// address at the start of the next page.
+	return enframe(g, 0, needed-UNIT-IB, 0);
+}
+
 void *aligned_alloc(size_t align, size_t len)
 {
 	if ((align & -align) != align) {
@@ -21,14 +63,38 @@ void *aligned_alloc(size_t align, size_t len)
 
 	if (align <= UNIT) align = UNIT;
 
-	unsigned char *p = malloc(len + align - UNIT);
+	size_t n = len + align - UNIT;
+#if USE_TINY
+	// the request must not be small enough to be served from a
+	// header-free tiny slot; set_size below records the real size.
+	if (n <= TINY_MAX) n = TINY_MAX+1;
+#endif
+
+	// requests that would be individually mmapped anyway are mapped
+	// directly at the desired alignment if it's at least a page. the
+	// page size isn't known yet if this is the first allocation.
+	size_t pagesize = PGSZ ? PGSZ : get_page_size();
+	unsigned char *p;
+	if (align >= pagesize && n >= MMAP_THRESHOLD) {
+		if (size_overflows(n)) return 0;
+		p = map_aligned(align, len, pagesize);
+	} else {
+		p = malloc(n);
+	}
+	if (!p) return 0;
+
 	struct meta *g = get_meta(p);
-	int idx = get_slot_index(p);
+	int idx = get_slot_index(g, p);
 	size_t stride = get_stride(g);
 	unsigned char *start = g->mem->storage + stride*idx;
 	unsigned char *end = g->mem->storage + stride*(idx+1) - IB;
 	size_t adj = -(uintptr_t)p & (align-1);
 
+	// rebuild p from the group's storage so that the compiler sees
+	// its in-band header as part of the same object, not as lying
+	// before the start of what malloc returned.
+	p = g->mem->storage + UNIT*((size_t)(p - g->mem->storage)/UNIT);
+
 	if (!adj) {
 		set_size(p, end, len);
 		return p;
@@ -45,7 +111,7 @@ void *aligned_alloc(size_t align, size_t len)
 		*(uint32_t *)(p-8) = offset;
 		p[-4] = 1;
 	}
-	p[-3] = idx;
+	p[-3] = idx & 31;
 	set_size(p, end, len);
 	// store offset to aligned enframing. this facilitates cycling
 	// offset and also iteration of heap for debugging/measurement.
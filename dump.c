@@ -1,69 +1,209 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "meta.h"
 
-static void print_group(FILE *f, struct meta *g)
+// heap snapshots are copied out one meta area at a time, each under a
+// short lock hold, into a buffer mmapped outside the heap, and only
+// formatted or written after the lock is released. the record and
+// header layouts below are also the binary format written by
+// malloc_export_heap, in native byte order, for offline viewers.
+
+#define SNAP_ACTIVE 1	// group is on its class's active list
+#define SNAP_HEAD 2	// group is the head of that list
+#define SNAP_FREEABLE 4
+
+struct snap_group {
+	uint64_t avail_mask, freed_mask;
+	uint64_t mem;
+	uint32_t maplen;	// in 4096-byte pages, 0 if nested
+	uint32_t stride;	// slot size in bytes
+	uint8_t sizeclass, last_idx, active_idx, flags;
+	uint32_t pad;
+};
+
+struct snap_header {
+	char magic[8];		// "mallocng"
+	uint32_t version, record_size;
+	uint64_t count;		// group records following the header
+	uint64_t free_meta, avail_meta, avail_meta_areas, mapped;
+	uint64_t usage_by_class[48];
+};
+
+struct snapshot {
+	struct snap_header h;
+	struct snap_group g[];
+};
+
+static void snap_group(struct snap_group *s, struct meta *g)
 {
-	size_t size = g->sizeclass>48
-		? g->maplen*4096UL-UNIT
-		: UNIT*size_classes[g->sizeclass];
-	fprintf(f, "%p: %p [%d slots] [class %d (%zu)]: ", g, g->mem,
-		g->last_idx+1, g->sizeclass, size);
-	for (int i=0; i<=g->last_idx; i++) {
-		putc((g->avail_mask & (1u<<i)) ? 'a'
-			: (i > g->mem->active_idx) ? 'i'
-			: (g->freed_mask & (1u<<i)) ? 'f' : '_', f);
-	}
-	putc('\n', f);
+	int sc = g->sizeclass;
+	s->avail_mask = g->avail_mask;
+	s->freed_mask = g->freed_mask;
+	s->mem = (uintptr_t)g->mem;
+	s->maplen = g->maplen;
+	s->stride = sc>=48 ? g->maplen*4096UL-UNIT : get_stride(g);
+	s->sizeclass = sc;
+	s->last_idx = g->last_idx;
+	// tiny groups have no header and are always fully active. the
+	// header of a single-slot group, individual mappings included,
+	// can be moved by realloc without the lock, so it's not read;
+	// its one slot is always active.
+	s->active_idx = sc-TINY_CLASS < 2U || !g->last_idx
+		? g->last_idx : g->mem->active_idx;
+	s->flags = (g->next ? SNAP_ACTIVE : 0) | (g->freeable ? SNAP_FREEABLE : 0);
+#if USE_TINY
+	if (sc-TINY_CLASS < 2U) {
+		s->stride = get_tiny_stride(g);
+		if (ctx.tiny_active[sc-TINY_CLASS] == g) s->flags |= SNAP_HEAD;
+	} else
+#endif
+	if (sc < 48 && ctx.active[sc] == g) s->flags |= SNAP_HEAD;
 }
 
-static void print_group_list(FILE *f, struct meta *h)
+static size_t count_list(struct meta *h)
 {
+	size_t cnt = 0;
 	struct meta *m = h;
-	if (!m) return;
-	do print_group(f, m);
+	if (!m) return 0;
+	do cnt++;
 	while ((m=m->next)!=h);
+	return cnt;
 }
 
-static void print_full_groups(FILE *f)
+static struct snapshot *take_snapshot(size_t *len)
 {
+	struct snapshot *s;
 	struct meta_area *p;
-	struct meta *m;
-	for (p=ctx.meta_area_head; p; p=p->next) {
-		for (int i=0; i<p->nslots; i++) {
-			m = &p->slots[i];
-			if (m->mem && !m->next)
-				print_group(f, m);
-		}
+	size_t n = 0, cnt = 0;
+
+	rdlock();
+	for (p=ctx.meta_area_head; p; p=p->next)
+		n += p->nslots;
+	unlock();
+
+	// leave room for areas added while copying; anything beyond
+	// is left out. the page size isn't known yet if the heap hasn't
+	// been initialized.
+	n += n/4 + 64;
+	size_t pagesize = PGSZ ? PGSZ : get_page_size();
+	*len = sizeof *s + n * sizeof *s->g;
+	*len += -*len & (pagesize-1);
+	s = mmap(0, *len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (s == MAP_FAILED) return 0;
+
+	rdlock();
+	memcpy(s->h.magic, "mallocng", 8);
+	s->h.version = 1;
+	s->h.record_size = sizeof *s->g;
+	s->h.free_meta = count_list(ctx.free_meta_head);
+	s->h.avail_meta = ctx.avail_meta_count;
+	s->h.avail_meta_areas = ctx.avail_meta_area_count;
+	s->h.mapped = ctx.mapped;
+	for (int i=0; i<48; i++)
+		s->h.usage_by_class[i] = ctx.usage_by_class[i];
+	p = ctx.meta_area_head;
+	unlock();
+
+	// meta areas are never freed, so the list can be followed
+	// between lock holds.
+	for (; p; p=p->next) {
+		rdlock();
+		for (int i=0; i<p->nslots && cnt<n; i++)
+			if (p->slots[i].mem)
+				snap_group(&s->g[cnt++], &p->slots[i]);
+		unlock();
 	}
+	s->h.count = cnt;
+	return s;
 }
 
-static size_t count_list(struct meta *h)
+static void print_group(FILE *f, const struct snap_group *g)
 {
-	size_t cnt = 0;
-	struct meta *m = h;
-	if (!m) return 0;
-	do cnt++;
-	while ((m=m->next)!=h);
-	return cnt;
+	fprintf(f, "%p: [%d slots] [class %d (%u)]: ", (void *)(uintptr_t)g->mem,
+		g->last_idx+1, g->sizeclass, g->stride);
+	for (int i=0; i<=g->last_idx; i++) {
+		putc((g->avail_mask & (1ull<<i)) ? 'a'
+			: (i > g->active_idx) ? 'i'
+			: (g->freed_mask & (1ull<<i)) ? 'f' : '_', f);
+	}
+	putc('\n', f);
+}
+
+static int has_class(const struct snapshot *s, int sc)
+{
+	for (size_t i=0; i<s->h.count; i++)
+		if (s->g[i].sizeclass == sc && (s->g[i].flags & SNAP_ACTIVE))
+			return 1;
+	return 0;
+}
+
+// print groups on the active list of class sc, head first.
+static void print_class(FILE *f, const struct snapshot *s, int sc)
+{
+	for (int head=1; head>=0; head--)
+		for (size_t i=0; i<s->h.count; i++)
+			if (s->g[i].sizeclass == sc
+			    && (s->g[i].flags & SNAP_ACTIVE)
+			    && !!(s->g[i].flags & SNAP_HEAD) == head)
+				print_group(f, &s->g[i]);
 }
 
 void dump_heap(FILE *f)
 {
-	wrlock();
+	size_t len;
+	struct snapshot *s = take_snapshot(&len);
+	if (!s) {
+		fprintf(f, "heap snapshot failed\n");
+		return;
+	}
 
-	fprintf(f, "free meta records: %zu\n", count_list(ctx.free_meta_head));
-	fprintf(f, "available new meta records: %zu\n", ctx.avail_meta_count);
-	fprintf(f, "available new meta areas: %zu\n", ctx.avail_meta_area_count);
+	fprintf(f, "free meta records: %llu\n", (unsigned long long)s->h.free_meta);
+	fprintf(f, "available new meta records: %llu\n", (unsigned long long)s->h.avail_meta);
+	fprintf(f, "available new meta areas: %llu\n", (unsigned long long)s->h.avail_meta_areas);
 
 	fprintf(f, "entirely filled, inactive groups:\n");
-	print_full_groups(f);
+	for (size_t i=0; i<s->h.count; i++)
+		if (!(s->g[i].flags & SNAP_ACTIVE))
+			print_group(f, &s->g[i]);
 
 	fprintf(f, "free groups by size class:\n");
 	for (int i=0; i<48; i++) {
-		if (!ctx.active[i]) continue;
-		fprintf(f, "-- class %d (%d) (%zu used) --\n", i, size_classes[i]*UNIT, ctx.usage_by_class[i]);
-		print_group_list(f, ctx.active[i]);
+		if (!has_class(s, i)) continue;
+		fprintf(f, "-- class %d (%d) (%llu used) --\n", i, size_classes[i]*UNIT,
+			(unsigned long long)s->h.usage_by_class[i]);
+		print_class(f, s, i);
+	}
+#if USE_TINY
+	for (int i=0; i<2; i++) {
+		if (!has_class(s, TINY_CLASS+i)) continue;
+		fprintf(f, "-- tiny class %d (%d) --\n", i, 8<<i);
+		print_class(f, s, TINY_CLASS+i);
 	}
+#endif
 
-	unlock();
+	munmap(s, len);
+}
+
+int malloc_export_heap(int fd)
+{
+	size_t len;
+	struct snapshot *s = take_snapshot(&len);
+	if (!s) return -1;
+	const unsigned char *p = (void *)s;
+	size_t n = sizeof s->h + s->h.count * sizeof *s->g;
+	while (n) {
+		ssize_t k = write(fd, p, n);
+		if (k < 0 && errno == EINTR) continue;
+		if (k <= 0) {
+			munmap(s, len);
+			return -1;
+		}
+		p += k;
+		n -= k;
+	}
+	munmap(s, len);
+	return 0;
 }
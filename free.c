@@ -4,17 +4,13 @@
 
 #include "meta.h"
 
-struct mapinfo {
-	void *base;
-	size_t len;
-};
-
 static struct mapinfo nontrivial_free(struct meta *, int);
 
-static struct mapinfo free_group(struct meta *g)
+struct mapinfo free_group(struct meta *g)
 {
 	struct mapinfo mi = { 0 };
 	int sc = g->sizeclass;
+	PROBE3(free_group, sc, g->last_idx+1, g->maplen);
 	if (sc < 48) {
 		ctx.usage_by_class[sc] -= g->last_idx+1;
 	}
@@ -23,10 +19,12 @@ static struct mapinfo free_group(struct meta *g)
 		record_seq(sc);
 		mi.base = g->mem;
 		mi.len = g->maplen*4096UL;
+		ctx.mapped -= mi.len;
+		pagemap_clear(mi.base, mi.len, g);
 	} else {
 		void *p = g->mem;
 		struct meta *m = get_meta(p);
-		int idx = get_slot_index(p);
+		int idx = get_slot_index(m, p);
 		g->mem->meta = 0;
 		// not checking size/reserved here; it's intentionally invalid
 		mi = nontrivial_free(m, idx);
@@ -41,6 +39,9 @@ static int okay_to_free(struct meta *g)
 
 	if (!g->freeable) return 0;
 
+	// don't retain anything when running low on memory.
+	if (memory_pressure()) return 1;
+
 	// always free individual mmaps not suitable for reuse
 	if (sc >= 48 || get_stride(g) < UNIT*size_classes[sc])
 		return 1;
@@ -71,11 +72,11 @@ static int okay_to_free(struct meta *g)
 
 static struct mapinfo nontrivial_free(struct meta *g, int i)
 {
-	uint32_t self = 1u<<i;
+	uint64_t self = 1ull<<i;
 	int sc = g->sizeclass;
-	uint32_t mask = g->freed_mask | g->avail_mask;
+	uint64_t mask = g->freed_mask | g->avail_mask;
 
-	if (mask+self == (2u<<g->last_idx)-1 && okay_to_free(g)) {
+	if (mask+self == (2ull<<g->last_idx)-1 && okay_to_free(g)) {
 		// any multi-slot group is necessarily on an active list
 		// here, but single-slot groups might or might not be.
 		if (g->next) {
@@ -91,47 +92,82 @@ static struct mapinfo nontrivial_free(struct meta *g, int i)
 		// might still be active if there were no allocations
 		// after last available slot was taken.
 		if (ctx.active[sc] != g) {
+#if FULLEST_FIRST
+			// having just one free slot, it's the fullest, so
+			// insert it after the active group.
+			if (ctx.active[sc]) queue(&ctx.active[sc]->next, g);
+			else
+#endif
 			queue(&ctx.active[sc], g);
 		}
 	}
-	a_or(&g->freed_mask, self);
+	a_or_64(&g->freed_mask, self);
 	return (struct mapinfo){ 0 };
 }
 
-void free(void *p)
+// n is the size the caller allocated, or -1 if unknown. it may be
+// less than the nominal size, which malloc_claim can raise later. a
+// known size is only checked; the slot is found and freed the same
+// way, so sized frees are no faster.
+static inline void free_slot(void *p, size_t n)
 {
 	if (!p) return;
+#if USE_TINY
+	if (is_tiny(p)) {
+		free_tiny(p);
+		return;
+	}
+#endif
 
 	struct meta *g = get_meta(p);
-	int idx = get_slot_index(p);
+	int idx = get_slot_index(g, p);
 	size_t stride = get_stride(g);
 	unsigned char *start = g->mem->storage + stride*idx;
 	unsigned char *end = start + stride - IB;
-	get_nominal_size(p, end);
-	uint32_t self = 1u<<idx, all = (2u<<g->last_idx)-1;
+	size_t size = get_nominal_size(p, end);
+	assert(n == -1 || n <= size);
+	uint64_t self = 1ull<<idx, all = (2ull<<g->last_idx)-1;
 	((unsigned char *)p)[-3] = 255;
 	// invalidate offset to group header, and cycle offset of
 	// used region within slot if current offset is zero.
 	*(uint16_t *)((char *)p-2) = 0;
 
+#if HOT_SLOTS
+	// keep the slot, still marked in use in the group's masks,
+	// for reuse by the next allocation of its class if there's
+	// room. single-slot groups are better unmapped. no lock is
+	// needed since a group can't go away while it has a slot in
+	// use.
+	if (g->sizeclass < 48 && g->last_idx && push_hot(g->sizeclass, g, idx))
+		return;
+#endif
+
 	// release any whole pages contained in the slot to be freed
-	// unless it's a single-slot group that will be unmapped.
-	if (((uintptr_t)(start-1) ^ (uintptr_t)end) >= 2*PGSZ && g->last_idx) {
+	// unless it's a single-slot group that will be unmapped or a
+	// reserved group whose pages are meant to stay resident. once
+	// the soft limit is reached, do so immediately and even for
+	// slots spanning fewer pages.
+	int pressure = memory_pressure() > 1;
+	if (((uintptr_t)(start-1) ^ (uintptr_t)end) >= (2-pressure)*PGSZ
+	    && g->last_idx && g->freeable) {
 		unsigned char *base = start + (-(uintptr_t)start & (PGSZ-1));
 		size_t len = (end-base) & -PGSZ;
-		if (len) madvise(base, len, MADV_FREE);
+		if (len) {
+			PROBE2(madvise, base, len);
+			mem_release(base, len, pressure ? MADV_DONTNEED : MADV_FREE);
+		}
 	}
 
 	// atomic free without locking if this is neither first or last slot
 	for (;;) {
-		uint32_t freed = g->freed_mask;
-		uint32_t avail = g->avail_mask;
-		uint32_t mask = freed | avail;
+		uint64_t freed = g->freed_mask;
+		uint64_t avail = g->avail_mask;
+		uint64_t mask = freed | avail;
 		assert(!(mask&self));
 		if (!freed || mask+self==all) break;
 		if (!MT)
 			g->freed_mask = freed+self;
-		else if (a_cas(&g->freed_mask, freed, freed+self)!=freed)
+		else if (a_cas_64(&g->freed_mask, freed, freed+self)!=freed)
 			continue;
 		return;
 	}
@@ -139,5 +175,21 @@ void free(void *p)
 	wrlock();
 	struct mapinfo mi = nontrivial_free(g, idx);
 	unlock();
-	if (mi.len) munmap(mi.base, mi.len);
+	if (mi.len) mem_unmap(mi.base, mi.len);
+}
+
+void free(void *p)
+{
+	free_slot(p, -1);
+}
+
+void free_sized(void *p, size_t n)
+{
+	free_slot(p, n);
+}
+
+// aligned allocations are found from the pointer like any other.
+void free_aligned_sized(void *p, size_t align, size_t n)
+{
+	free_slot(p, n);
 }
@@ -4,14 +4,36 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <limits.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <sys/auxv.h>
 
 // use macros to appropriately namespace these. for libc,
 // the names would be changed to lie in __ namespace.
 #define size_classes malloc_size_classes
 #define ctx malloc_context
 #define alloc_meta malloc_alloc_meta
+#define alloc_group malloc_alloc_group
+#define free_group malloc_free_group
+#define pagemap malloc_pagemap
+#define pagemap_set malloc_pagemap_set
+#define pagemap_clear malloc_pagemap_clear
+#define pagemap_mix malloc_pagemap_mix
+#define mem_map malloc_mem_map
+#define mem_unmap malloc_mem_unmap
+#define mem_remap malloc_mem_remap
+#define mem_release malloc_mem_release
 #define is_allzero malloc_allzerop
+#define init_limits malloc_init_limits
+#define init_profile malloc_init_profile
+#define boot_arena malloc_boot_arena
+#define alloc_tiny malloc_alloc_tiny
+#define free_tiny malloc_free_tiny
+
+#ifndef USE_BOOTSTRAP
+#define USE_BOOTSTRAP 0
+#endif
 
 #if USE_REAL_ASSERT
 #include <assert.h>
@@ -51,11 +73,31 @@ static inline int a_clz_32(uint32_t x)
 	return __builtin_clz(x);
 }
 
+static inline int a_ctz_64(uint64_t x)
+{
+	return __builtin_ctzll(x);
+}
+
+static inline int a_clz_64(uint64_t x)
+{
+	return __builtin_clzll(x);
+}
+
+static inline int a_popcount_64(uint64_t x)
+{
+	return __builtin_popcountll(x);
+}
+
 static inline int a_cas(volatile int *p, int t, int s)
 {
 	return __sync_val_compare_and_swap(p, t, s);
 }
 
+static inline uint64_t a_cas_64(volatile uint64_t *p, uint64_t t, uint64_t s)
+{
+	return __sync_val_compare_and_swap(p, t, s);
+}
+
 static inline int a_swap(volatile int *p, int v)
 {
 	int x;
@@ -69,6 +111,77 @@ static inline void a_or(volatile int *p, int v)
 	__sync_fetch_and_or(p, v);
 }
 
+static inline void a_or_64(volatile uint64_t *p, uint64_t v)
+{
+	__sync_fetch_and_or(p, v);
+}
+
+static inline int a_fetch_add(volatile int *p, int v)
+{
+	return __sync_fetch_and_add(p, v);
+}
+
+static inline void a_spin()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__ ("" : : : "memory");
+#endif
+}
+
+#if USE_BOOTSTRAP
+// take both from the aux vector, which needs no syscall. libc uses
+// the AT_RANDOM bytes for its stack protector canary and pointer
+// guard, and the secret is stored in every meta area, so it's
+// derived from them one-way, as SipHash-2-4 of a constant keyed
+// with them.
+#include <string.h>
+
+static inline uint64_t a_rol_64(uint64_t x, int b)
+{
+	return x << b | x >> (64-b);
+}
+
+#define SIPROUND do { \
+	v0 += v1; v1 = a_rol_64(v1,13); v1 ^= v0; v0 = a_rol_64(v0,32); \
+	v2 += v3; v3 = a_rol_64(v3,16); v3 ^= v2; \
+	v0 += v3; v3 = a_rol_64(v3,21); v3 ^= v0; \
+	v2 += v1; v1 = a_rol_64(v1,17); v1 ^= v2; v2 = a_rol_64(v2,32); \
+} while (0)
+
+static inline uint64_t siphash_64(const uint64_t k[2], uint64_t m)
+{
+	uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k[1] ^ 0x7465646279746573ULL;
+	uint64_t b = 8ULL << 56;
+	v3 ^= m; SIPROUND; SIPROUND; v0 ^= m;
+	v3 ^= b; SIPROUND; SIPROUND; v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline uint64_t get_random_secret()
+{
+	uint64_t k[2], secret;
+	const char *r = (const char *)getauxval(AT_RANDOM);
+	if (!r) {
+		getentropy(&secret, sizeof secret);
+		return secret;
+	}
+	memcpy(k, r, sizeof k);
+	return siphash_64(k, 0x676e636f6c6c616dULL);
+}
+
+static inline size_t get_page_size()
+{
+	size_t pagesize = getauxval(AT_PAGESZ);
+	return pagesize ? pagesize : sysconf(_SC_PAGESIZE);
+}
+#else
 static inline uint64_t get_random_secret()
 {
 	uint64_t secret;
@@ -80,12 +193,95 @@ static inline size_t get_page_size()
 {
 	return sysconf(_SC_PAGESIZE);
 }
+#endif
+
+// setuid and similar programs mustn't let whoever runs them pick the
+// files or limits the heap uses.
+static inline const char *get_env(const char *name)
+{
+	return getauxval(AT_SECURE) ? 0 : getenv(name);
+}
 
+#if USE_MT_DETECT && defined(__has_include)
+#if __has_include(<sys/single_threaded.h>)
+#define MT_LIBC 1
+#endif
+#endif
+
+#if MT_LIBC
+// glibc clears this on every thread creation, including that of its
+// own helper threads, and never sets it again.
+#include <sys/single_threaded.h>
+#define MT (!__libc_single_threaded)
+#elif USE_MT_DETECT
+// there's no portable "is multithreaded" predicate, so keep one by
+// hooking thread creation; see mt.c. negative means unknown.
+__attribute__((__visibility__("hidden")))
+extern volatile int malloc_mt;
+#define MT malloc_mt
+#else
 // no portable "is multithreaded" predicate so assume true
 #define MT 1
+#endif
+
+// with USE_SDT, the PROBE macros emit SystemTap-style USDT probes,
+// a nop plus an ELF note describing where to find the arguments,
+// usable by perf, bpftrace and the like. the note format is written
+// out here since sys/sdt.h is not always available.
+#ifndef USE_SDT
+#define USE_SDT 0
+#endif
+
+#if USE_SDT
+#if __LP64__
+#define SDT_ADDR ".8byte "
+#define SDT_ARG "-8@"
+#else
+#define SDT_ADDR ".4byte "
+#define SDT_ARG "-4@"
+#endif
+#define SDT_NOTE(name, args, ...) __asm__ __volatile__ ( \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: " SDT_ADDR "990b\n" \
+	SDT_ADDR "_.stapsdt.base\n" \
+	SDT_ADDR "0\n" \
+	".asciz \"mallocng\"\n" \
+	".asciz \"" name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n" \
+	:: __VA_ARGS__)
+#define PROBE0(name) SDT_NOTE(#name, "")
+#define PROBE1(name, a) SDT_NOTE(#name, SDT_ARG "%0", \
+	"nor"((long)(a)))
+#define PROBE2(name, a, b) SDT_NOTE(#name, SDT_ARG "%0 " SDT_ARG "%1", \
+	"nor"((long)(a)), "nor"((long)(b)))
+#define PROBE3(name, a, b, c) SDT_NOTE(#name, \
+	SDT_ARG "%0 " SDT_ARG "%1 " SDT_ARG "%2", \
+	"nor"((long)(a)), "nor"((long)(b)), "nor"((long)(c)))
+#else
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
 
 #define LOCK_TYPE_MUTEX 1
 #define LOCK_TYPE_RWLOCK 2
+#define LOCK_TYPE_FUTEX 3
 
 #ifndef LOCK_TYPE
 #define LOCK_TYPE LOCK_TYPE_MUTEX
@@ -101,13 +297,17 @@ extern pthread_mutex_t malloc_lock;
 #define LOCK_OBJ_DEF \
 pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER
 
+// with probes enabled, try the lock first so contention is seen.
 static inline void rdlock()
 {
-	if (MT) pthread_mutex_lock(&malloc_lock);
+	if (!MT) return;
+	if (USE_SDT && !pthread_mutex_trylock(&malloc_lock)) return;
+	PROBE0(lock_contended);
+	pthread_mutex_lock(&malloc_lock);
 }
 static inline void wrlock()
 {
-	if (MT) pthread_mutex_lock(&malloc_lock);
+	rdlock();
 }
 static inline void unlock()
 {
@@ -127,13 +327,20 @@ extern pthread_rwlock_t malloc_lock;
 #define LOCK_OBJ_DEF \
 pthread_rwlock_t malloc_lock = PTHREAD_RWLOCK_INITIALIZER
 
+// with probes enabled, try the lock first so contention is seen.
 static inline void rdlock()
 {
-	if (MT) pthread_rwlock_rdlock(&malloc_lock);
+	if (!MT) return;
+	if (USE_SDT && !pthread_rwlock_tryrdlock(&malloc_lock)) return;
+	PROBE0(lock_contended);
+	pthread_rwlock_rdlock(&malloc_lock);
 }
 static inline void wrlock()
 {
-	if (MT) pthread_rwlock_wrlock(&malloc_lock);
+	if (!MT) return;
+	if (USE_SDT && !pthread_rwlock_trywrlock(&malloc_lock)) return;
+	PROBE0(lock_contended);
+	pthread_rwlock_wrlock(&malloc_lock);
 }
 static inline void unlock()
 {
@@ -145,6 +352,109 @@ static inline void upgradelock()
 	wrlock();
 }
 
+#elif LOCK_TYPE == LOCK_TYPE_FUTEX
+
+#include <sys/syscall.h>
+
+#define RDLOCK_IS_EXCLUSIVE 0
+
+// number of times to retry a contended lock before sleeping.
+#ifndef LOCK_SPIN
+#define LOCK_SPIN 100
+#endif
+
+// malloc_lock[0] is the count of read locks held, or -1 if write-
+// locked. [1] counts sleeping waiters and [2] writers waiting, which
+// keep new readers out so they can't starve writers. sleepers wait
+// on [3], which a release bumps when there are any. the lock word
+// itself can't be waited on, since it may return to the value a
+// sleeper saw before the sleeper gets to the futex wait.
+__attribute__((__visibility__("hidden")))
+extern volatile int malloc_lock[4];
+
+#define LOCK_OBJ_DEF \
+volatile int malloc_lock[4]
+
+// a sleeper registers before its final check of the lock, so that a
+// release after that check either sees it and wakes it, or changes
+// the sequence number so the wait returns at once.
+static inline int lock_register()
+{
+	int seq = malloc_lock[3];
+	a_fetch_add(&malloc_lock[1], 1);
+	return seq;
+}
+
+static inline void lock_wait(int seq, int blocked)
+{
+	if (blocked) {
+		PROBE0(lock_contended);
+		syscall(SYS_futex, malloc_lock+3, 0|128, seq, 0);
+	}
+	a_fetch_add(&malloc_lock[1], -1);
+}
+
+static inline void lock_wake()
+{
+	if (malloc_lock[1]) {
+		a_fetch_add(&malloc_lock[3], 1);
+		syscall(SYS_futex, malloc_lock+3, 1|128, INT_MAX);
+	}
+}
+
+static inline void rdlock()
+{
+	if (!MT) return;
+	for (int spins=0; ; spins++) {
+		int v = malloc_lock[0];
+		if (v >= 0 && !malloc_lock[2]) {
+			if (a_cas(malloc_lock, v, v+1)==v) return;
+			continue;
+		}
+		if (spins < LOCK_SPIN) {
+			a_spin();
+			continue;
+		}
+		int seq = lock_register();
+		lock_wait(seq, malloc_lock[0] < 0 || malloc_lock[2]);
+	}
+}
+static inline void wrlock()
+{
+	if (!MT) return;
+	int waiting = 0;
+	for (int spins=0; ; spins++) {
+		int v = malloc_lock[0];
+		if (!v) {
+			if (a_cas(malloc_lock, 0, -1)==0) break;
+			continue;
+		}
+		if (!waiting) {
+			a_fetch_add(&malloc_lock[2], 1);
+			waiting = 1;
+		}
+		if (spins < LOCK_SPIN) {
+			a_spin();
+			continue;
+		}
+		int seq = lock_register();
+		lock_wait(seq, malloc_lock[0] != 0);
+	}
+	if (waiting) a_fetch_add(&malloc_lock[2], -1);
+}
+static inline void unlock()
+{
+	if (!MT) return;
+	if (malloc_lock[0] < 0) a_swap(malloc_lock, 0);
+	else if (a_fetch_add(malloc_lock, -1) != 1) return;
+	lock_wake();
+}
+static inline void upgradelock()
+{
+	unlock();
+	wrlock();
+}
+
 #endif
 
 #endif
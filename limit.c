@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "meta.h"
+
+static size_t parse_size(const char *s)
+{
+	size_t n = 0;
+	for (; *s>='0' && *s<='9'; s++) n = 10*n + (*s-'0');
+	switch (*s) {
+	case 'g': case 'G': n <<= 10;
+	case 'm': case 'M': n <<= 10;
+	case 'k': case 'K': n <<= 10;
+	}
+	return n;
+}
+
+void init_limits(void)
+{
+	const char *s;
+	if (!ctx.soft_limit && (s = get_env("MALLOC_SOFT_LIMIT")))
+		ctx.soft_limit = parse_size(s);
+	if (!ctx.hard_limit && (s = get_env("MALLOC_HARD_LIMIT")))
+		ctx.hard_limit = parse_size(s);
+}
+
+int malloc_set_limit(size_t soft, size_t hard)
+{
+	if (hard && soft > hard) {
+		errno = EINVAL;
+		return -1;
+	}
+	wrlock();
+	ctx.soft_limit = soft;
+	ctx.hard_limit = hard;
+	unlock();
+	return 0;
+}
@@ -9,6 +9,10 @@
 
 LOCK_OBJ_DEF;
 
+#if CUSTOM_CLASSES
+// generated by tools/mkclasses from a size profile; see Makefile.
+#include "classes.h"
+#else
 const uint16_t size_classes[] = {
 	1, 2, 3, 4, 5, 6, 7, 8,
 	9, 10, 12, 15,
@@ -23,22 +27,47 @@ const uint16_t size_classes[] = {
 	4680, 5460, 6552, 8191,
 };
 
-static const uint8_t small_cnt_tab[][3] = {
-	{ 30, 30, 30 },
-	{ 31, 15, 15 },
-	{ 20, 10, 10 },
-	{ 31, 15, 7 },
-	{ 25, 12, 6 },
-	{ 21, 10, 5 },
-	{ 18, 8, 4 },
-	{ 31, 15, 7 },
-	{ 28, 14, 6 },
+static const uint8_t med_cnt_tab[48] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 24, 20, 32, 28, 24, 20, 32,
+	28, 24, 20, 32, 28, 24, 20, 32,
+	28, 24, 20, 32, 28, 24, 20, 32,
+	28, 24, 20, 32, 28, 24, 20, 32,
+	28, 24, 20, 32, 28, 24, 20, 32,
 };
+#endif
 
-static const uint8_t med_cnt_tab[4] = { 28, 24, 20, 32 };
+// the first column gives counts up to 64 for classes in heavy use;
+// these double the group size while still fitting just below the
+// next power of two.
+static const uint8_t small_cnt_tab[][4] = {
+	{ 62, 30, 30, 30 },
+	{ 63, 31, 15, 15 },
+	{ 42, 20, 10, 10 },
+	{ 63, 31, 15, 7 },
+	{ 51, 25, 12, 6 },
+	{ 42, 21, 10, 5 },
+	{ 36, 18, 8, 4 },
+	{ 63, 31, 15, 7 },
+	{ 56, 28, 14, 6 },
+};
 
 struct malloc_context ctx = { 0 };
 
+#if USE_BOOTSTRAP
+struct boot_arena boot_arena __attribute__((__aligned__(BOOT_GUARD)));
+
+// the arena is only used once its guards are in place.
+static int guard_boot_arena(void)
+{
+	if (!ctx.boot_guarded) {
+		ctx.boot_guarded = mprotect(boot_arena.guard_lo, BOOT_GUARD, PROT_NONE)
+			|| mprotect(boot_arena.guard_hi, BOOT_GUARD, PROT_NONE) ? -1 : 1;
+	}
+	return ctx.boot_guarded > 0;
+}
+#endif
+
 struct meta *alloc_meta(void)
 {
 	struct meta *m;
@@ -48,6 +77,8 @@ struct meta *alloc_meta(void)
 		ctx.pagesize = get_page_size();
 #endif
 		ctx.secret = get_random_secret();
+		init_limits();
+		init_profile();
 		ctx.init_done = 1;
 	}
 	size_t pagesize = PGSZ;
@@ -55,6 +86,23 @@ struct meta *alloc_meta(void)
 	if ((m = dequeue_head(&ctx.free_meta_head))) return m;
 	if (!ctx.avail_meta_count) {
 		int need_unprotect = 1;
+		// with a region attached, meta areas come from it too.
+		if (!ctx.avail_meta_area_count && ctx.region) {
+			p = mem_map(pagesize);
+			if (p==MAP_FAILED) return 0;
+			ctx.avail_meta_areas = p;
+			ctx.avail_meta_area_count = pagesize>>12;
+			need_unprotect = 0;
+		}
+#if USE_BOOTSTRAP
+		// the first area is static, kept from the boot arena by
+		// its upper guard.
+		if (!ctx.avail_meta_area_count && !ctx.meta_area_head) {
+			ctx.avail_meta_areas = boot_arena.meta_area;
+			ctx.avail_meta_area_count = 1;
+			need_unprotect = 0;
+		}
+#endif
 		if (!ctx.avail_meta_area_count && ctx.brk!=-1) {
 			uintptr_t new = ctx.brk + pagesize;
 			int need_guard = 0;
@@ -104,6 +152,7 @@ struct meta *alloc_meta(void)
 		ctx.avail_meta_count = ctx.meta_area_tail->nslots
 			= (4096-sizeof(struct meta_area))/sizeof *m;
 		ctx.avail_meta = ctx.meta_area_tail->slots;
+		PROBE2(meta_area, p, ctx.avail_meta_area_count);
 	}
 	ctx.avail_meta_count--;
 	m = ctx.avail_meta++;
@@ -111,12 +160,12 @@ struct meta *alloc_meta(void)
 	return m;
 }
 
-static uint32_t try_avail(struct meta **pm)
+static uint64_t try_avail(struct meta **pm)
 {
 	struct meta *m = *pm;
-	uint32_t first;
+	uint64_t first;
 	if (!m) return 0;
-	uint32_t mask = m->avail_mask;
+	uint64_t mask = m->avail_mask;
 	if (!mask) {
 		if (!m) return 0;
 		if (!m->freed_mask) {
@@ -128,11 +177,26 @@ static uint32_t try_avail(struct meta **pm)
 			*pm = m;
 		}
 
+#if FULLEST_FIRST
+		// of the next few groups, take the one with the fewest
+		// freed slots. those passed over move behind it.
+		struct meta *c = m;
+		int best = a_popcount_64(m->freed_mask);
+		for (int i=1; i<FULLEST_FIRST && (c=c->next)!=*pm; i++) {
+			int n = a_popcount_64(c->freed_mask);
+			if (n && n < best) {
+				best = n;
+				m = c;
+			}
+		}
+		*pm = m;
+#endif
+
 		mask = m->freed_mask;
 
 		// skip fully-free group unless it's the only one
 		// or it's a permanently non-freeable group
-		if (mask == (2u<<m->last_idx)-1 && m->freeable) {
+		if (mask == (2ull<<m->last_idx)-1 && m->freeable) {
 			m = m->next;
 			*pm = m;
 			mask = m->freed_mask;
@@ -142,7 +206,7 @@ static uint32_t try_avail(struct meta **pm)
 		// if needed, but only as a last resort. prefer using
 		// any other group with free slots. this avoids
 		// touching & dirtying as-yet-unused pages.
-		if (!(mask & ((2u<<m->mem->active_idx)-1))) {
+		if (!(mask & ((2ull<<m->mem->active_idx)-1))) {
 			if (m->next != m) {
 				m = m->next;
 				*pm = m;
@@ -171,7 +235,7 @@ static uint32_t try_avail(struct meta **pm)
 
 static int alloc_slot(int, size_t);
 
-static struct meta *alloc_group(int sc, size_t req)
+struct meta *alloc_group(int sc, size_t req)
 {
 	size_t size = UNIT*size_classes[sc];
 	int i = 0, cnt;
@@ -181,15 +245,23 @@ static struct meta *alloc_group(int sc, size_t req)
 	size_t usage = ctx.usage_by_class[sc];
 	size_t pagesize = PGSZ;
 	int active_idx;
+	int pressure = memory_pressure();
+
+	// a peak from a saved profile stands in for usage until it's
+	// reached. under memory pressure, size groups as if the class
+	// were barely used so as not to allocate slots eagerly.
+	if (usage < ctx.usage_seed[sc]) usage = ctx.usage_seed[sc];
+	else ctx.usage_seed[sc] = 0;
+	if (pressure) usage = 0;
 	if (sc < 9) {
-		while (i<2 && 4*small_cnt_tab[sc][i] > usage)
+		while (i<3 && 4*small_cnt_tab[sc][i] > usage)
 			i++;
 		cnt = small_cnt_tab[sc][i];
 	} else {
 		// lookup max number of slots fitting in power-of-two size
 		// from a table, along with number of factors of two we
 		// can divide out without a remainder or reaching 1.
-		cnt = med_cnt_tab[sc&3];
+		cnt = med_cnt_tab[sc];
 
 		// reduce cnt to avoid excessive eagar allocation.
 		while (!(cnt&1) && 4*cnt > usage)
@@ -211,7 +283,7 @@ static struct meta *alloc_group(int sc, size_t req)
 		// check/update bounce counter to start/increase retention
 		// of freed maps, and inhibit use of low-count, odd-size
 		// small mappings and single-slot groups if activated.
-		int nosmall = is_bouncing(sc);
+		int nosmall = is_bouncing(sc) && !pressure;
 		account_bounce(sc);
 		step_seq();
 
@@ -246,12 +318,27 @@ static struct meta *alloc_group(int sc, size_t req)
 			}
 		}
 
-		p = mmap(0, needed, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+		if (exceeds_limit(needed)) {
+			free_meta(m);
+			return 0;
+		}
+		p = MAP_FAILED;
+#if USE_BOOTSTRAP
+		// single-slot groups are meant to be unmapped when freed,
+		// so they aren't worth pinning in the arena.
+		if (!ctx.region && cnt > 1 && needed <= BOOT_ARENA - ctx.boot_used
+		    && guard_boot_arena()) {
+			p = boot_arena.arena + ctx.boot_used;
+			ctx.boot_used += needed;
+		}
+#endif
+		if (p==MAP_FAILED) p = mem_map(needed);
 		if (p==MAP_FAILED) {
 			free_meta(m);
 			return 0;
 		}
 		m->maplen = needed>>12;
+		ctx.mapped += needed;
 		ctx.mmap_counter++;
 		active_idx = (4096-UNIT)/size-1;
 		if (active_idx > cnt-1) active_idx = cnt-1;
@@ -272,21 +359,26 @@ static struct meta *alloc_group(int sc, size_t req)
 		active_idx = cnt-1;
 	}
 	ctx.usage_by_class[sc] += cnt;
-	m->avail_mask = (2u<<active_idx)-1;
-	m->freed_mask = (2u<<(cnt-1))-1 - m->avail_mask;
+	if (ctx.usage_by_class[sc] > ctx.usage_peak[sc])
+		ctx.usage_peak[sc] = ctx.usage_by_class[sc];
+	m->avail_mask = (2ull<<active_idx)-1;
+	m->freed_mask = (2ull<<(cnt-1))-1 - m->avail_mask;
 	m->mem = (void *)p;
 	m->mem->meta = m;
 	m->mem->active_idx = active_idx;
 	m->last_idx = cnt-1;
-	m->freeable = 1;
+	m->freeable = !(m->maplen && is_boot(p));
 	m->sizeclass = sc;
+	if (m->maplen) pagemap_set(p, m->maplen*4096UL, m);
+	else pagemap_mix(p, UNIT+cnt*size);
+	PROBE3(alloc_group, sc, cnt, m->maplen);
 	return m;
 }
 
 static int alloc_slot(int sc, size_t req)
 {
-	uint32_t first = try_avail(&ctx.active[sc]);
-	if (first) return a_ctz_32(first);
+	uint64_t first = try_avail(&ctx.active[sc]);
+	if (first) return a_ctz_64(first);
 
 	struct meta *g = alloc_group(sc, req);
 	if (!g) return -1;
@@ -300,22 +392,22 @@ void *malloc(size_t n)
 {
 	if (size_overflows(n)) return 0;
 	struct meta *g;
-	uint32_t mask, first;
+	uint64_t mask, first;
 	int sc;
 	int idx;
 	int ctr;
 
 	if (n >= MMAP_THRESHOLD) {
 		size_t needed = n + IB + UNIT;
-		void *p = mmap(0, needed, PROT_READ|PROT_WRITE,
-			MAP_PRIVATE|MAP_ANON, -1, 0);
+		if (exceeds_limit(needed)) return 0;
+		void *p = mem_map(needed);
 		if (p==MAP_FAILED) return 0;
 		wrlock();
 		step_seq();
 		g = alloc_meta();
 		if (!g) {
 			unlock();
-			munmap(p, needed);
+			mem_unmap(p, needed);
 			return 0;
 		}
 		g->mem = p;
@@ -324,7 +416,10 @@ void *malloc(size_t n)
 		g->freeable = 1;
 		g->sizeclass = 63;
 		g->maplen = (needed+4095)/4096;
+		ctx.mapped += g->maplen*4096UL;
 		g->avail_mask = g->freed_mask = 0;
+		pagemap_set(p, g->maplen*4096UL, g);
+		PROBE2(large_mmap, p, g->maplen*4096UL);
 		// use a global counter to cycle offset in
 		// individually-mmapped allocations.
 		ctx.mmap_counter++;
@@ -332,6 +427,13 @@ void *malloc(size_t n)
 		goto success;
 	}
 
+#if USE_TINY
+	if (n <= TINY_MAX && !ctx.region) {
+		void *p = alloc_tiny(n);
+		if (p) return p;
+	}
+#endif
+
 	sc = size_to_class(n);
 
 	rdlock();
@@ -340,8 +442,10 @@ void *malloc(size_t n)
 	// use coarse size classes initially when there are not yet
 	// any groups of desired size. this allows counts of 2 or 3
 	// to be allocated at first rather than having to start with
-	// 7 or 5, the min counts for even size classes.
-	if (!g && sc>=4 && sc<32 && sc!=6 && !(sc&1) && !ctx.usage_by_class[sc]) {
+	// 7 or 5, the min counts for even size classes. not worth it
+	// if a profile says the class will see heavy use.
+	if (!g && sc>=4 && sc<32 && sc!=6 && !(sc&1) && !ctx.usage_by_class[sc]
+	    && !ctx.usage_seed[sc]) {
 		size_t usage = ctx.usage_by_class[sc|1];
 		// if a new group may be allocated, count it toward
 		// usage in deciding if we can use coarse class.
@@ -353,15 +457,25 @@ void *malloc(size_t n)
 		g = ctx.active[sc];
 	}
 
+#if HOT_SLOTS
+	{
+		struct meta *h = pop_hot(sc, &idx);
+		if (h) {
+			g = h;
+			goto success;
+		}
+	}
+#endif
+
 	for (;;) {
 		mask = g ? g->avail_mask : 0;
 		first = mask&-mask;
 		if (!first) break;
 		if (RDLOCK_IS_EXCLUSIVE || !MT)
 			g->avail_mask = mask-first;
-		else if (a_cas(&g->avail_mask, mask, mask-first)!=mask)
+		else if (a_cas_64(&g->avail_mask, mask, mask-first)!=mask)
 			continue;
-		idx = a_ctz_32(first);
+		idx = a_ctz_64(first);
 		goto success;
 	}
 	upgradelock();
@@ -379,9 +493,12 @@ success:
 	return enframe(g, idx, n, ctr);
 }
 
+// groups that aren't freeable outlive their slots being freed, so
+// even a fresh-looking single-slot one may have been written to.
 int is_allzero(void *p)
 {
+	if (is_tiny(p)) return 0;
 	struct meta *g = get_meta(p);
-	return g->sizeclass >= 48 ||
-		get_stride(g) < UNIT*size_classes[g->sizeclass];
+	return g->freeable && (g->sizeclass >= 48 ||
+		get_stride(g) < UNIT*size_classes[g->sizeclass]);
 }
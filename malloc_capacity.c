@@ -0,0 +1,15 @@
+#include <stdlib.h>
+#include "meta.h"
+
+size_t malloc_capacity(void *p)
+{
+#if USE_TINY
+	if (is_tiny(p)) return get_tiny_stride(get_tiny_meta(p));
+#endif
+	struct meta *g = get_meta(p);
+	int idx = get_slot_index(g, p);
+	size_t stride = get_stride(g);
+	unsigned char *start = g->mem->storage + stride*idx;
+	unsigned char *end = start + stride - IB;
+	return end-(unsigned char *)p;
+}
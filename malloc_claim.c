@@ -0,0 +1,19 @@
+#include <stdlib.h>
+#include "meta.h"
+
+// extend the nominal size of the allocation to all of its slot,
+// returning the new size.
+size_t malloc_claim(void *p)
+{
+#if USE_TINY
+	if (is_tiny(p)) return get_tiny_stride(get_tiny_meta(p));
+#endif
+	struct meta *g = get_meta(p);
+	int idx = get_slot_index(g, p);
+	size_t stride = get_stride(g);
+	unsigned char *start = g->mem->storage + stride*idx;
+	unsigned char *end = start + stride - IB;
+	get_nominal_size(p, end);
+	set_size(p, end, end-(unsigned char *)p);
+	return end-(unsigned char *)p;
+}
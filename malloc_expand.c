@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "meta.h"
+
+// grow the allocation at p to at least n bytes without moving it,
+// returning the resulting size, which is less than n on failure.
+size_t malloc_expand(void *p, size_t n)
+{
+#if USE_TINY
+	if (is_tiny(p)) return get_tiny_stride(get_tiny_meta(p));
+#endif
+	struct meta *g = get_meta(p);
+	int idx = get_slot_index(g, p);
+	size_t stride = get_stride(g);
+	unsigned char *start = g->mem->storage + stride*idx;
+	unsigned char *end = start + stride - IB;
+	size_t old_size = get_nominal_size(p, end);
+
+	if (n <= old_size || size_overflows(n)) return old_size;
+
+	if (n <= end-(unsigned char *)p) {
+		set_size(p, end, n);
+		return n;
+	}
+
+	// an allocation alone in its mapping can grow if the pages
+	// following it are free. mremap without MREMAP_MAYMOVE
+	// either extends the mapping in place or fails.
+	if (!g->maplen || g->last_idx || !g->freeable)
+		return old_size;
+	size_t base = (unsigned char *)p-start;
+	size_t needed = (n + base + UNIT + IB + 4095) & -4096;
+	size_t oldlen = g->maplen*4096UL;
+	if (exceeds_limit(needed - oldlen)) return old_size;
+	if (mem_remap(g->mem, oldlen, needed, 0) == MAP_FAILED)
+		return old_size;
+	PROBE3(expand_mremap, p, old_size, n);
+	wrlock();
+	// only a group that did grow leaves its size class.
+	unclass_group(g);
+	ctx.mapped += needed - oldlen;
+	pagemap_set(g->mem, needed, g);
+	unlock();
+	g->maplen = needed/4096;
+	end = g->mem->storage + (needed - UNIT) - IB;
+	*end = 0;
+	set_size(p, end, n);
+	return n;
+}
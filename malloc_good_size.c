@@ -0,0 +1,22 @@
+#include <stdlib.h>
+#include "meta.h"
+
+// the largest size for which malloc lands in the same size class or
+// the same number of pages as malloc(n). a request of a class with
+// slots larger than a page may get a single-slot group of just the
+// pages it needs, which is then the limit. the usable size of any
+// one allocation can differ slightly with where in its slot or
+// mapping it was placed.
+size_t malloc_good_size(size_t n)
+{
+	if (size_overflows(n)) return 0;
+#if USE_TINY
+	if (n <= TINY_MAX) return n <= 8 ? 8 : 16;
+#endif
+	if (n >= MMAP_THRESHOLD)
+		return ((n + IB + UNIT + 4095) & -4096) - UNIT - IB;
+	size_t pagesize = PGSZ ? PGSZ : get_page_size();
+	size_t size = UNIT*size_classes[size_to_class(n)];
+	size_t req = (n + IB + UNIT + pagesize-1) & -pagesize;
+	return (req - UNIT < size ? req - UNIT : size) - IB;
+}
@@ -3,8 +3,11 @@
 
 size_t malloc_usable_size(void *p)
 {
+#if USE_TINY
+	if (is_tiny(p)) return get_tiny_stride(get_tiny_meta(p));
+#endif
 	struct meta *g = get_meta(p);
-	int idx = get_slot_index(p);
+	int idx = get_slot_index(g, p);
 	size_t stride = get_stride(g);
 	unsigned char *start = g->mem->storage + stride*idx;
 	unsigned char *end = start + stride - IB;
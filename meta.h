@@ -14,22 +14,108 @@ extern const uint16_t size_classes[];
 #define UNIT 16
 #define IB 4
 
+// tiny objects of up to 8 or 16 bytes are optionally served from
+// header-free 64-slot groups in a reserved region, with ownership
+// resolved out-of-band by address. sizeclass values following the
+// 48 regular ones identify these groups.
+#define TINY_MAX 16
+#define TINY_CLASS 48
+#define TINY_GRANULE 512
+
+#ifndef TINY_REGION
+#if UINTPTR_MAX > 0xffffffff
+#define TINY_REGION (1UL<<30)
+#else
+#define TINY_REGION (1UL<<24)
+#endif
+#endif
+
 struct group {
 	struct meta *meta;
-	unsigned char active_idx:5;
+	unsigned char active_idx:6;
 	char pad[UNIT - sizeof(struct meta *) - 1];
 	unsigned char storage[];
 };
 
+// meta records are aligned to META_ALIGN bytes. setting it to the
+// cache line size gives each record a line of its own, so that the
+// atomic updates of different groups' masks from threads working on
+// different classes don't contend, at the cost of fewer records per
+// meta area (63 rather than 84 with 64-byte lines on 64-bit).
+#ifndef META_ALIGN
+#define META_ALIGN 1
+#endif
+
+// maplen gets what's left of a word after the other fields: 19 bits
+// of 4096-byte pages on 32-bit targets, so just under 2GB.
+#define MAPLEN_BITS (8*sizeof(uintptr_t)-13)
+
 struct meta {
 	struct meta *prev, *next;
 	struct group *mem;
-	volatile int avail_mask, freed_mask;
-	uintptr_t last_idx:5;
+	volatile uint64_t avail_mask, freed_mask;
+	uintptr_t last_idx:6;
 	uintptr_t freeable:1;
 	uintptr_t sizeclass:6;
-	uintptr_t maplen:8*sizeof(uintptr_t)-12;
-};
+	uintptr_t maplen:MAPLEN_BITS;
+} __attribute__((__aligned__(META_ALIGN)));
+
+// with HOT_SLOTS nonzero, up to that many recently freed slots of
+// each class are kept in a stack and handed out again first, trading
+// the long reuse interval for cache locality. CYCLE_OFFSET=0 further
+// stops cycling the offset of the used region within a slot.
+#ifndef HOT_SLOTS
+#define HOT_SLOTS 0
+#endif
+
+#ifndef CYCLE_OFFSET
+#define CYCLE_OFFSET 1
+#endif
+
+// with FULLEST_FIRST nonzero, try_avail looks at up to that many
+// groups when the current one runs out and moves on to the fullest,
+// and groups that were full are queued next in line rather than
+// last, so that sparse groups can drain and be freed.
+#ifndef FULLEST_FIRST
+#define FULLEST_FIRST 0
+#endif
+
+// with USE_REGIONS, group and large allocation memory is carved from
+// anonymous chunks of REGION_SIZE bytes instead of being mapped one
+// piece at a time, and returned with madvise rather than munmap.
+// requests over a sixteenth of a chunk are still mapped by themselves.
+#ifndef USE_REGIONS
+#define USE_REGIONS 0
+#endif
+
+#ifndef REGION_SIZE
+#define REGION_SIZE (64UL<<20)
+#endif
+#define REGION_MAX 256
+
+// with USE_PAGEMAP, get_meta looks groups backed by whole pages up
+// in an out-of-band table by address rather than following the
+// in-band offset to the group header and checking the meta area;
+// see pagemap.c.
+#ifndef USE_PAGEMAP
+#define USE_PAGEMAP 0
+#endif
+
+// with USE_BOOTSTRAP, the first meta area and the first BOOT_ARENA
+// bytes worth of multi-slot groups come from static storage, and
+// the secret and page size from the aux vector, so the first
+// allocations need no syscalls. groups in the arena are never freed.
+#ifndef BOOT_ARENA
+#define BOOT_ARENA (128UL<<10)
+#endif
+
+#if UINTPTR_MAX > 0xffffffff
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_TOP_BITS 18
+#else
+#define PAGEMAP_LEAF_BITS 10
+#define PAGEMAP_TOP_BITS 10
+#endif
 
 struct meta_area {
 	uint64_t check;
@@ -52,9 +138,31 @@ struct malloc_context {
 	unsigned char *avail_meta_areas;
 	struct meta *active[48];
 	size_t usage_by_class[48];
+	size_t usage_peak[48], usage_seed[48];
 	uint8_t unmap_seq[32], bounces[32];
 	uint8_t seq;
 	uintptr_t brk;
+	size_t mapped, soft_limit, hard_limit;
+	struct region *region;
+	size_t region_len;
+#if USE_BOOTSTRAP
+	size_t boot_used;
+	int boot_guarded;
+#endif
+#if USE_REGIONS
+	struct region *volatile anon_region[REGION_MAX];
+	volatile int anon_region_cnt;
+#endif
+#if HOT_SLOTS
+	volatile uint64_t hot[48][HOT_SLOTS];
+#endif
+#if USE_TINY
+	unsigned char *tiny_base;
+	size_t tiny_len;
+	struct meta **tiny_map;
+	struct meta *tiny_active[2];
+	size_t tiny_top[2], tiny_commit[2];
+#endif
 };
 
 __attribute__((__visibility__("hidden")))
@@ -72,6 +180,99 @@ struct meta *alloc_meta(void);
 __attribute__((__visibility__("hidden")))
 int is_allzero(void *);
 
+struct mapinfo {
+	void *base;
+	size_t len;
+};
+
+__attribute__((__visibility__("hidden")))
+struct meta *alloc_group(int, size_t);
+
+__attribute__((__visibility__("hidden")))
+struct mapinfo free_group(struct meta *);
+
+__attribute__((__visibility__("hidden")))
+void *mem_map(size_t);
+
+__attribute__((__visibility__("hidden")))
+void mem_unmap(void *, size_t);
+
+__attribute__((__visibility__("hidden")))
+void *mem_remap(void *, size_t, size_t, int);
+
+__attribute__((__visibility__("hidden")))
+void mem_release(void *, size_t, int);
+
+__attribute__((__visibility__("hidden")))
+void init_limits(void);
+
+__attribute__((__visibility__("hidden")))
+void init_profile(void);
+
+#if USE_BOOTSTRAP
+// the arena sits between guard pages, made inaccessible when it's
+// first used, so that overflowing its groups can't reach the static
+// meta area above it or whatever the linker put next to it, possibly
+// ctx. they're sized and aligned for pages of up to BOOT_GUARD.
+#define BOOT_GUARD 65536
+
+struct boot_arena {
+	unsigned char guard_lo[BOOT_GUARD];
+	unsigned char arena[(BOOT_ARENA + BOOT_GUARD-1) & -BOOT_GUARD];
+	unsigned char guard_hi[BOOT_GUARD];
+	unsigned char meta_area[4096];
+};
+
+__attribute__((__visibility__("hidden")))
+extern struct boot_arena boot_arena;
+
+static inline int is_boot(const void *p)
+{
+	return (uintptr_t)p - (uintptr_t)boot_arena.arena < BOOT_ARENA;
+}
+#else
+static inline int is_boot(const void *p)
+{
+	return 0;
+}
+#endif
+
+#if USE_PAGEMAP
+__attribute__((__visibility__("hidden")))
+extern uintptr_t *pagemap[];
+
+__attribute__((__visibility__("hidden")))
+void pagemap_set(const void *, size_t, struct meta *);
+
+__attribute__((__visibility__("hidden")))
+void pagemap_clear(const void *, size_t, struct meta *);
+
+__attribute__((__visibility__("hidden")))
+void pagemap_mix(const void *, size_t);
+
+static inline struct meta *pagemap_get(const void *p)
+{
+	uintptr_t page = (uintptr_t)p >> 12;
+	if (page >> (PAGEMAP_TOP_BITS + PAGEMAP_LEAF_BITS)) return 0;
+	uintptr_t *leaf = pagemap[page >> PAGEMAP_LEAF_BITS];
+	if (!leaf) return 0;
+	uintptr_t e = leaf[page & ((1UL<<PAGEMAP_LEAF_BITS)-1)];
+	return e & 1 ? 0 : (struct meta *)e;
+}
+#else
+static inline void pagemap_set(const void *p, size_t len, struct meta *g) {}
+static inline void pagemap_clear(const void *p, size_t len, struct meta *g) {}
+static inline void pagemap_mix(const void *p, size_t len) {}
+#endif
+
+#if USE_TINY
+__attribute__((__visibility__("hidden")))
+void *alloc_tiny(size_t);
+
+__attribute__((__visibility__("hidden")))
+void free_tiny(void *);
+#endif
+
 static inline void queue(struct meta **phead, struct meta *m)
 {
 	assert(!m->next);
@@ -112,38 +313,59 @@ static inline void free_meta(struct meta *m)
 	queue(&ctx.free_meta_head, m);
 }
 
-static inline uint32_t activate_group(struct meta *m)
+static inline uint64_t activate_group(struct meta *m)
 {
 	assert(!m->avail_mask);
-	uint32_t mask, act = (2u<<m->mem->active_idx)-1;
+	uint64_t mask, act = (2ull<<m->mem->active_idx)-1;
 	do mask = m->freed_mask;
-	while (a_cas(&m->freed_mask, mask, mask&~act)!=mask);
+	while (a_cas_64(&m->freed_mask, mask, mask&~act)!=mask);
 	return m->avail_mask = mask & act;
 }
 
-static inline int get_slot_index(const unsigned char *p)
+// only the low 5 bits of the slot index fit in the in-band header.
+// in groups of more than 32 slots, which are all of small classes
+// with 16-bit offsets, the high bit is recovered from the offset.
+static inline int get_slot_index_at(const unsigned char *p, size_t offset, int sc)
 {
-	return p[-3] & 31;
+	int index = p[-3] & 31;
+	if (sc < 48 && offset >= 32*size_classes[sc]) index += 32;
+	return index;
+}
+
+static inline int get_slot_index(const struct meta *g, const unsigned char *p)
+{
+	return get_slot_index_at(p, (size_t)(p-g->mem->storage)/UNIT, g->sizeclass);
 }
 
 static inline struct meta *get_meta(const unsigned char *p)
 {
 	assert(!((uintptr_t)p & 15));
 	int offset = *(const uint16_t *)(p - 2);
-	int index = get_slot_index(p);
 	if (p[-4]) {
 		assert(!offset);
 		offset = *(uint32_t *)(p - 8);
 		assert(offset > 0xffff);
 	}
 	const struct group *base = (const void *)(p - UNIT*offset - UNIT);
-	const struct meta *meta = base->meta;
-	assert(meta->mem == base);
+	const struct meta *meta;
+#if USE_PAGEMAP
+	// a meta pointer from the page map is known good, so neither the
+	// group header nor the meta area need be read; the in-band
+	// offset is still checked against it.
+	if ((meta = pagemap_get(p))) {
+		assert(meta->mem == base);
+	} else
+#endif
+	{
+		meta = base->meta;
+		assert(meta->mem == base);
+		const struct meta_area *area = (void *)((uintptr_t)meta & -4096);
+		assert(area->check == ctx.secret);
+	}
+	int index = get_slot_index_at(p, offset, meta->sizeclass);
 	assert(index <= meta->last_idx);
-	assert(!(meta->avail_mask & (1u<<index)));
-	assert(!(meta->freed_mask & (1u<<index)));
-	const struct meta_area *area = (void *)((uintptr_t)meta & -4096);
-	assert(area->check == ctx.secret);
+	assert(!(meta->avail_mask & (1ull<<index)));
+	assert(!(meta->freed_mask & (1ull<<index)));
 	if (meta->sizeclass < 48) {
 		assert(offset >= size_classes[meta->sizeclass]*index);
 		assert(offset < size_classes[meta->sizeclass]*(index+1));
@@ -156,6 +378,69 @@ static inline struct meta *get_meta(const unsigned char *p)
 	return (struct meta *)meta;
 }
 
+#if HOT_SLOTS
+// a hot slot entry is the group's meta pointer shifted over the slot
+// index, or 0 if empty, so it can be claimed or filled with one cas.
+// user addresses fit in well under 58 bits.
+static inline uint64_t hot_entry(const struct meta *g, int idx)
+{
+	return (uint64_t)(uintptr_t)g << 6 | idx;
+}
+
+// fill the lowest empty entry, so that pops from the top are LIFO
+// when uncontended.
+static inline int push_hot(int sc, struct meta *g, int idx)
+{
+	for (int i=0; i<HOT_SLOTS; i++)
+		if (!ctx.hot[sc][i] && !a_cas_64(&ctx.hot[sc][i], 0, hot_entry(g, idx)))
+			return 1;
+	return 0;
+}
+
+static inline struct meta *pop_hot(int sc, int *idx)
+{
+	for (int i=HOT_SLOTS; i--; ) {
+		uint64_t e = ctx.hot[sc][i];
+		if (e && a_cas_64(&ctx.hot[sc][i], e, 0) == e) {
+			*idx = e & 63;
+			return (struct meta *)(uintptr_t)(e >> 6);
+		}
+	}
+	return 0;
+}
+#endif
+
+#if USE_TINY
+static inline int is_tiny(const void *p)
+{
+	return (uintptr_t)p - (uintptr_t)ctx.tiny_base < ctx.tiny_len;
+}
+
+static inline size_t get_tiny_stride(const struct meta *g)
+{
+	return 8 << (g->sizeclass - TINY_CLASS);
+}
+
+static inline struct meta *get_tiny_meta(const unsigned char *p)
+{
+	size_t offset = p - ctx.tiny_base;
+	int t = offset >= TINY_REGION;
+	assert(!(offset & ((8<<t)-1)));
+	const struct meta *meta = ctx.tiny_map[offset/TINY_GRANULE];
+	assert(meta);
+	assert(meta->sizeclass == TINY_CLASS+t);
+	int index = (p - (unsigned char *)meta->mem) >> (3+t);
+	assert(index <= meta->last_idx);
+	assert(!(meta->avail_mask & (1ull<<index)));
+	assert(!(meta->freed_mask & (1ull<<index)));
+	const struct meta_area *area = (void *)((uintptr_t)meta & -4096);
+	assert(area->check == ctx.secret);
+	return (struct meta *)meta;
+}
+#else
+#define is_tiny(p) 0
+#endif
+
 static inline size_t get_nominal_size(const unsigned char *p, const unsigned char *end)
 {
 	size_t reserved = p[-3] >> 5;
@@ -201,7 +486,11 @@ static inline void *enframe(struct meta *g, int idx, size_t n, int ctr)
 	unsigned char *end = p+stride-IB;
 	// cycle offset within slot to increase interval to address
 	// reuse, facilitate trapping double-free.
+#if CYCLE_OFFSET
 	int off = (p[-3] ? *(uint16_t *)(p-2) + 1 : ctr) & 255;
+#else
+	int off = 0;
+#endif
 	assert(!p[-4]);
 	if (off > slack) {
 		size_t m = slack;
@@ -221,7 +510,7 @@ static inline void *enframe(struct meta *g, int idx, size_t n, int ctr)
 		p[-4] = 0;
 	}
 	*(uint16_t *)(p-2) = (size_t)(p-g->mem->storage)/UNIT;
-	p[-3] = idx;
+	p[-3] = idx & 31;
 	set_size(p, end, n);
 	return p;
 }
@@ -237,15 +526,53 @@ static inline int size_to_class(size_t n)
 	return i;
 }
 
+// the mapping for n, header and rounding to the page size included,
+// must still have a length maplen can hold.
 static inline int size_overflows(size_t n)
 {
-	if (n >= SIZE_MAX/2 - 4096) {
+	if (n >= SIZE_MAX/2 - 4096
+	    || n>>12 >= ((size_t)1<<MAPLEN_BITS) - 64) {
+		errno = ENOMEM;
+		return 1;
+	}
+	return 0;
+}
+
+// as mapped memory approaches the soft limit, pressure is 1 and
+// groups are no longer retained or made larger than needed. once
+// it's reached, pressure is 2 and freed pages are released eagerly.
+static inline int memory_pressure(void)
+{
+	if (!ctx.soft_limit) return 0;
+	if (ctx.mapped >= ctx.soft_limit) return 2;
+	return ctx.mapped >= ctx.soft_limit - ctx.soft_limit/8;
+}
+
+static inline int exceeds_limit(size_t len)
+{
+	if (ctx.hard_limit && ctx.mapped + len > ctx.hard_limit) {
 		errno = ENOMEM;
 		return 1;
 	}
 	return 0;
 }
 
+// turn a single-slot group of a size class into an unclassed
+// mapping so its length can change. called with the lock held.
+static inline void unclass_group(struct meta *g)
+{
+	int sc = g->sizeclass;
+	if (sc >= 48) return;
+	if (g->next) {
+		int activate_new = (ctx.active[sc]==g);
+		dequeue(&ctx.active[sc], g);
+		if (activate_new && ctx.active[sc])
+			activate_group(ctx.active[sc]);
+	}
+	ctx.usage_by_class[sc]--;
+	g->sizeclass = 63;
+}
+
 static inline void step_seq(void)
 {
 	if (ctx.seq==255) {
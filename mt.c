@@ -0,0 +1,15 @@
+#include "meta.h"
+
+#if USE_MT_DETECT && !MT_LIBC
+
+// -1 until thread creation is known to be hooked, so that a program
+// linked without the hooks keeps locking; 0 once hooked with no
+// threads created yet; 1 forever after the first thread creation.
+// the hooks live in mt_wrap.c, pulled into fully static programs by
+// linking with -Wl,--wrap=pthread_create,--wrap=thrd_create. where
+// the libc is shared, threads it or other shared libraries create
+// can't be seen, so the flag is never cleared there.
+
+volatile int malloc_mt = -1;
+
+#endif
@@ -0,0 +1,34 @@
+#include <pthread.h>
+#include <threads.h>
+#include <sys/auxv.h>
+#include "meta.h"
+
+#if USE_MT_DETECT && !MT_LIBC
+
+int __real_pthread_create(pthread_t *restrict, const pthread_attr_t *restrict,
+	void *(*)(void *), void *restrict);
+int __real_thrd_create(thrd_t *, thrd_start_t, void *);
+
+int __wrap_pthread_create(pthread_t *restrict t, const pthread_attr_t *restrict a,
+	void *(*f)(void *), void *restrict arg)
+{
+	malloc_mt = 1;
+	return __real_pthread_create(t, a, f, arg);
+}
+
+int __wrap_thrd_create(thrd_t *t, thrd_start_t f, void *arg)
+{
+	malloc_mt = 1;
+	return __real_thrd_create(t, f, arg);
+}
+
+// --wrap only redirects references linked into the program itself,
+// so the hooks see every thread creation only if there's no dynamic
+// linker and hence no shared library to create threads behind them.
+__attribute__((__constructor__))
+static void init_mt(void)
+{
+	if (malloc_mt < 0 && !getauxval(AT_BASE)) malloc_mt = 0;
+}
+
+#endif
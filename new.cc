@@ -0,0 +1,147 @@
+#include <new>
+#include <cstdlib>
+
+// replacement operator new and delete, built into libmallocng++
+// along with the C interface. the new_handler is only consulted
+// once an allocation has failed, and sized deletes pass the size
+// through to free_sized to be checked.
+
+extern "C" void free_sized(void *, size_t);
+
+static void *alloc_slow(size_t n, size_t align)
+{
+	for (;;) {
+		void *p = align ? aligned_alloc(align, n) : malloc(n);
+		if (p) return p;
+		std::new_handler h = std::get_new_handler();
+		if (!h) throw std::bad_alloc();
+		h();
+	}
+}
+
+static inline void *alloc(size_t n)
+{
+	void *p = malloc(n);
+	if (__builtin_expect(!p, 0)) p = alloc_slow(n, 0);
+	return p;
+}
+
+static inline void *alloc_aligned(size_t n, std::align_val_t a)
+{
+	void *p = aligned_alloc(size_t(a), n);
+	if (__builtin_expect(!p, 0)) p = alloc_slow(n, size_t(a));
+	return p;
+}
+
+static inline void *alloc_nothrow(size_t n, size_t align) noexcept
+{
+	void *p = align ? aligned_alloc(align, n) : malloc(n);
+	if (__builtin_expect(!p, 0) && std::get_new_handler()) {
+		try {
+			p = alloc_slow(n, align);
+		} catch (...) {
+			p = 0;
+		}
+	}
+	return p;
+}
+
+void *operator new(size_t n)
+{
+	return alloc(n);
+}
+
+void *operator new[](size_t n)
+{
+	return alloc(n);
+}
+
+void *operator new(size_t n, std::align_val_t a)
+{
+	return alloc_aligned(n, a);
+}
+
+void *operator new[](size_t n, std::align_val_t a)
+{
+	return alloc_aligned(n, a);
+}
+
+void *operator new(size_t n, const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(n, 0);
+}
+
+void *operator new[](size_t n, const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(n, 0);
+}
+
+void *operator new(size_t n, std::align_val_t a, const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(n, size_t(a));
+}
+
+void *operator new[](size_t n, std::align_val_t a, const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(n, size_t(a));
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t n) noexcept
+{
+	free_sized(p, n);
+}
+
+void operator delete[](void *p, size_t n) noexcept
+{
+	free_sized(p, n);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t n, std::align_val_t) noexcept
+{
+	free_sized(p, n);
+}
+
+void operator delete[](void *p, size_t n, std::align_val_t) noexcept
+{
+	free_sized(p, n);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "meta.h"
+
+#if USE_PAGEMAP
+
+// the page map is a two-level table from 4096-byte page numbers to
+// the page-backed group covering the page, filled in when a group
+// or individual mapping is created and cleared when it's released.
+// leaves are mapped on first use and never freed. an entry with its
+// low bit set marks a page shared with a nested group, for which the
+// lookup gives up and the in-band header is used. updates are made
+// under the malloc lock; lookups only ever concern pages of live
+// allocations, so they need none.
+
+uintptr_t *pagemap[1UL<<PAGEMAP_TOP_BITS];
+
+static uintptr_t *get_leaf(uintptr_t page, int create)
+{
+	uintptr_t *leaf = pagemap[page >> PAGEMAP_LEAF_BITS];
+	if (leaf || !create) return leaf;
+	leaf = mmap(0, sizeof *leaf << PAGEMAP_LEAF_BITS, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	if (leaf == MAP_FAILED) return 0;
+	return pagemap[page >> PAGEMAP_LEAF_BITS] = leaf;
+}
+
+#define LEAF_MASK ((1UL<<PAGEMAP_LEAF_BITS)-1)
+
+// one past the last page of [p,p+len) that the map covers.
+static uintptr_t page_end(const void *p, size_t len)
+{
+	uintptr_t end = ((uintptr_t)p + len + 4095) >> 12;
+	uintptr_t max = 1UL << (PAGEMAP_TOP_BITS + PAGEMAP_LEAF_BITS);
+	return end < max ? end : max;
+}
+
+// pages the map can't represent or record are simply left out, and
+// looked up in-band instead.
+void pagemap_set(const void *p, size_t len, struct meta *g)
+{
+	uintptr_t page = (uintptr_t)p >> 12, end = page_end(p, len);
+	for (; page < end; page++) {
+		uintptr_t *leaf = get_leaf(page, 1);
+		if (leaf) leaf[page & LEAF_MASK] = (uintptr_t)g;
+	}
+}
+
+// only entries still naming g are cleared, since its old pages may
+// already belong to another group after a moving mremap.
+void pagemap_clear(const void *p, size_t len, struct meta *g)
+{
+	uintptr_t page = (uintptr_t)p >> 12, end = page_end(p, len);
+	for (; page < end; page++) {
+		uintptr_t *leaf = get_leaf(page, 0);
+		if (leaf && (leaf[page & LEAF_MASK] & -2) == (uintptr_t)g)
+			leaf[page & LEAF_MASK] = 0;
+	}
+}
+
+void pagemap_mix(const void *p, size_t len)
+{
+	uintptr_t page = (uintptr_t)p >> 12, end = page_end(p, len);
+	for (; page < end; page++) {
+		uintptr_t *leaf = get_leaf(page, 0);
+		if (leaf && leaf[page & LEAF_MASK])
+			leaf[page & LEAF_MASK] |= 1;
+	}
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "meta.h"
+
+// a usage profile records the peak slot count of each size class
+// and the bounce counters. when MALLOC_PROFILE names a file, it's
+// read at heap initialization to seed group sizing, so groups start
+// at the sizes the last run ended up with, and rewritten at exit.
+// the format is native-endian and specific to the size class table.
+
+struct profile {
+	char magic[8];
+	uint32_t version, classes;
+	uint16_t size_classes[48];
+	uint64_t peak[48];
+	uint8_t bounces[32];
+};
+
+static int full_io(int fd, void *buf, size_t n, int wr)
+{
+	unsigned char *p = buf;
+	while (n) {
+		ssize_t k = wr ? write(fd, p, n) : read(fd, p, n);
+		if (k < 0 && errno == EINTR) continue;
+		if (k <= 0) return -1;
+		p += k;
+		n -= k;
+	}
+	return 0;
+}
+
+// called with the lock held, from heap initialization.
+void init_profile(void)
+{
+	struct profile pf;
+	const char *s = get_env("MALLOC_PROFILE");
+	if (!s || !*s) return;
+	int e = errno, fd = open(s, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		errno = e;
+		return;
+	}
+	int r = full_io(fd, &pf, sizeof pf, 0);
+	close(fd);
+	errno = e;
+	if (r || memcmp(pf.magic, "mngprof", 8) || pf.version != 1
+	    || pf.classes != 48
+	    || memcmp(pf.size_classes, size_classes, sizeof pf.size_classes))
+		return;
+	for (int i=0; i<48; i++)
+		ctx.usage_seed[i] = pf.peak[i];
+	for (int i=0; i<32; i++)
+		ctx.bounces[i] = pf.bounces[i];
+}
+
+// the file is written under a temporary name and renamed into place
+// so a concurrent reader never sees a partial profile. the name is
+// per-process so that concurrent writers, forked children included,
+// each write their own.
+int malloc_save_profile(const char *path)
+{
+	struct profile pf = { .magic = "mngprof", .version = 1, .classes = 48 };
+	char tmp[PATH_MAX];
+	if (!path) path = get_env("MALLOC_PROFILE");
+	if (!path || !*path) {
+		errno = EINVAL;
+		return -1;
+	}
+	int l = snprintf(tmp, sizeof tmp, "%s.%d.tmp", path, (int)getpid());
+	if (l < 0 || l >= sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	rdlock();
+	memcpy(pf.size_classes, size_classes, sizeof pf.size_classes);
+	for (int i=0; i<48; i++)
+		pf.peak[i] = ctx.usage_peak[i];
+	for (int i=0; i<32; i++)
+		pf.bounces[i] = ctx.bounces[i];
+	unlock();
+
+	// a leftover from an earlier process with the same pid is
+	// replaced, not written through.
+	unlink(tmp);
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+	if (full_io(fd, &pf, sizeof pf, 1)) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	return rename(tmp, path);
+}
+
+// nothing to save from a process that never set up the heap.
+__attribute__((__destructor__))
+static void save_profile(void)
+{
+	int e = errno;
+	if (ctx.init_done) malloc_save_profile(0);
+	errno = e;
+}
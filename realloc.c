@@ -9,8 +9,20 @@ void *realloc(void *p, size_t n)
 	if (!p) return malloc(n);
 	if (size_overflows(n)) return 0;
 
+#if USE_TINY
+	if (is_tiny(p)) {
+		size_t stride = get_tiny_stride(get_tiny_meta(p));
+		if (n <= stride) return p;
+		void *new = malloc(n);
+		if (!new) return 0;
+		memcpy(new, p, stride);
+		free(p);
+		return new;
+	}
+#endif
+
 	struct meta *g = get_meta(p);
-	int idx = get_slot_index(p);
+	int idx = get_slot_index(g, p);
 	size_t stride = get_stride(g);
 	unsigned char *start = g->mem->storage + stride*idx;
 	unsigned char *end = start + stride - IB;
@@ -25,15 +37,39 @@ void *realloc(void *p, size_t n)
 		return p;
 	}
 
-	// use mremap if old and new size are both mmap-worthy
-	if (g->sizeclass>=48 && n>=MMAP_THRESHOLD) {
-		assert(g->sizeclass==63);
+	// use mremap if the allocation is alone in its own mapping and
+	// the new size is either mmap-worthy or large enough that whole
+	// pages waste little. a single-slot group of a size class is
+	// converted in place to an unclassed mapping for this, unless
+	// it's reserved, and a shrinking mapping just releases its tail
+	// pages. a group still in its class can be reached through the
+	// active list, so it's remapped under the lock and only leaves
+	// the class once that has succeeded.
+	if (g->maplen && !g->last_idx && g->freeable
+	    && (n>=MMAP_THRESHOLD || n+IB+UNIT >= 4*PGSZ)) {
 		size_t base = (unsigned char *)p-start;
 		size_t needed = (n + base + UNIT + IB + 4095) & -4096;
-		new = g->maplen*4096UL == needed ? g->mem :
-			mremap(g->mem, g->maplen*4096UL, needed, MREMAP_MAYMOVE);
+		size_t oldlen = g->maplen*4096UL;
+		int classed = g->sizeclass < 48;
+		if (needed > oldlen && exceeds_limit(needed - oldlen))
+			return 0;
+		if (classed) wrlock();
+		new = oldlen == needed ? g->mem :
+			mem_remap(g->mem, oldlen, needed, MREMAP_MAYMOVE);
+		if (new==MAP_FAILED && classed) unlock();
 		if (new!=MAP_FAILED) {
-			g->mem = new;
+			if (oldlen != needed) {
+				PROBE3(realloc_mremap, p, old_size, n);
+				if (!classed) wrlock();
+				ctx.mapped += needed - oldlen;
+				pagemap_clear(g->mem, oldlen, g);
+				pagemap_set(new, needed, g);
+			}
+			if (classed || oldlen != needed) {
+				unclass_group(g);
+				g->mem = new;
+				unlock();
+			}
 			g->maplen = needed/4096;
 			p = g->mem->storage + base;
 			end = g->mem->storage + (needed - UNIT) - IB;
@@ -43,6 +79,7 @@ void *realloc(void *p, size_t n)
 		}
 	}
 
+	PROBE3(realloc_copy, p, old_size, n);
 	new = malloc(n);
 	if (!new) return 0;
 	memcpy(new, p, n < old_size ? n : old_size);
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "meta.h"
+
+// a region is a range of pages carved into extents in whole pages.
+// its header, including a bitmap of pages in use and the lock
+// protecting it, lives at the start of the region itself. freed
+// extents are returned to the kernel but stay part of the region,
+// and adjacent free extents merge by virtue of the bitmap.
+//
+// an attached region is a shared mapping of a file or memfd from
+// which all group, large allocation and meta area memory is then
+// carved. since the header is in the file, several processes mapping
+// it can allocate from it concurrently, and extents survive a
+// restart. pointers are absolute, so the region must be mapped at
+// the same address in every process for them to be meaningful
+// there. the rest of the heap state (ctx) is per-process and not
+// kept in the region, so extents a process leaves behind can be
+// read by its successors, found through the root pointer in the
+// header, but not freed; malloc_reset_region frees them all once
+// no process is using the region.
+//
+// with USE_REGIONS, private anonymous regions of REGION_SIZE are
+// used the same way to back groups and smaller large allocations,
+// which keeps the number of mappings and of mmap/munmap calls down.
+
+#define REGION_MAGIC 0x016e6f6967657268ULL
+#define REGION_SPIN 100
+
+struct region {
+	uint64_t magic;
+	volatile int lock;
+	int shared;
+	void *root;
+	size_t pagesize, pages, hint, free, nofit;
+	uint64_t map[];
+};
+
+static void spin_lock(volatile int *lock)
+{
+	for (int spins=0; a_cas(lock, 0, 1); spins++) {
+		if (spins < REGION_SPIN) a_spin();
+		else sched_yield();
+	}
+}
+
+static void spin_unlock(volatile int *lock)
+{
+	a_swap(lock, 0);
+}
+
+static int page_used(struct region *r, size_t i)
+{
+	return r->map[i/64] >> (i%64) & 1;
+}
+
+static void mark_pages(struct region *r, size_t i, size_t n, int used)
+{
+	r->free += used ? -n : n;
+	for (; n; i++, n--) {
+		if (used) r->map[i/64] |= 1ull << (i%64);
+		else r->map[i/64] &= ~(1ull << (i%64));
+	}
+}
+
+// first fit from the hint, wrapping once. a run can only span words
+// through their free low and high bits, so for requests of a word or
+// more only those need counting; shorter ones, and the last partial
+// word, are looked at page by page.
+static size_t find_pages(struct region *r, size_t n)
+{
+	size_t nw = (r->pages+63)/64, w = r->hint/64, run = 0;
+	for (size_t seen=0; seen <= nw; seen++, w++) {
+		if (w == nw) {
+			w = 0;
+			run = 0;
+		}
+		uint64_t m = r->map[w];
+		if ((w+1)*64 > r->pages || (n < 64 && m && m != -1ull)) {
+			for (size_t i=w*64; i<w*64+64 && i<r->pages; i++) {
+				if (page_used(r, i)) run = 0;
+				else if (++run == n) return i+1-n;
+			}
+			continue;
+		}
+		size_t low = m ? a_ctz_64(m) : 64;
+		if (run + low >= n) return w*64 - run;
+		run = m ? a_clz_64(m) : run + 64;
+	}
+	return -1;
+}
+
+static size_t page_count(struct region *r, size_t len)
+{
+	return (len + r->pagesize-1) / r->pagesize;
+}
+
+static size_t page_index(struct region *r, const void *p)
+{
+	return ((unsigned char *)p - (unsigned char *)r) / r->pagesize;
+}
+
+static void *region_alloc(struct region *r, size_t len)
+{
+	size_t n = page_count(r, len), i = -1;
+	// nofit is the smallest request to have failed since pages were
+	// last freed, so that full regions are passed over quickly.
+	spin_lock(&r->lock);
+	if (n <= r->free && n < r->nofit) i = find_pages(r, n);
+	if (i != -1) {
+		mark_pages(r, i, n, 1);
+		r->hint = i + n;
+	} else if (n < r->nofit) {
+		r->nofit = n;
+	}
+	spin_unlock(&r->lock);
+	if (i == -1) return 0;
+	return (unsigned char *)r + i*r->pagesize;
+}
+
+static void region_free(struct region *r, void *p, size_t len)
+{
+	size_t i = page_index(r, p), n = page_count(r, len);
+	// extents must read as zero when reused, as fresh mappings do.
+#ifdef MADV_REMOVE
+	if (r->shared) madvise(p, n*r->pagesize, MADV_REMOVE);
+	else
+#endif
+	madvise(p, n*r->pagesize, MADV_DONTNEED);
+	spin_lock(&r->lock);
+	mark_pages(r, i, n, 0);
+	if (i < r->hint) r->hint = i;
+	r->nofit = -1;
+	spin_unlock(&r->lock);
+}
+
+// extents can shrink, or grow into free pages right after them, but
+// never move.
+static void *region_remap(struct region *r, void *p, size_t old_len, size_t new_len)
+{
+	size_t i = page_index(r, p), j;
+	size_t old_n = page_count(r, old_len), new_n = page_count(r, new_len);
+	if (new_n < old_n) {
+		region_free(r, (unsigned char *)p + new_n*r->pagesize,
+			(old_n-new_n)*r->pagesize);
+		return p;
+	}
+	spin_lock(&r->lock);
+	for (j=i+old_n; j<i+new_n && j<r->pages && !page_used(r, j); j++);
+	if (j == i+new_n) mark_pages(r, i+old_n, new_n-old_n, 1);
+	spin_unlock(&r->lock);
+	return j == i+new_n ? p : MAP_FAILED;
+}
+
+static size_t header_pages(size_t pages, size_t pagesize)
+{
+	size_t hdr = sizeof(struct region) + (pages+63)/64*8;
+	return (hdr + pagesize-1) / pagesize;
+}
+
+static void init_region(struct region *r, size_t pages, size_t pagesize, int shared)
+{
+	r->shared = shared;
+	r->root = 0;
+	r->pagesize = pagesize;
+	r->pages = pages;
+	r->hint = 0;
+	r->free = pages;
+	r->nofit = -1;
+	memset(r->map, 0, (pages+63)/64*8);
+	mark_pages(r, 0, header_pages(pages, pagesize), 1);
+	r->magic = REGION_MAGIC;
+}
+
+#if USE_REGIONS
+static volatile int anon_lock;
+
+// regions are only ever appended, and the count is published after
+// the new entry, so the array can be read without a lock.
+static void *anon_alloc(size_t len)
+{
+	void *p;
+	int i, cnt = ctx.anon_region_cnt;
+	for (i=cnt; i--; )
+		if ((p = region_alloc(ctx.anon_region[i], len)))
+			return p;
+
+	// large allocations can come before the heap is initialized.
+	spin_lock(&anon_lock);
+	if (ctx.anon_region_cnt == cnt && cnt < REGION_MAX) {
+		size_t pagesize = get_page_size();
+		struct region *r = mmap(0, REGION_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+		if (r != MAP_FAILED) {
+			init_region(r, REGION_SIZE/pagesize, pagesize, 0);
+			ctx.anon_region[cnt] = r;
+			a_swap(&ctx.anon_region_cnt, cnt+1);
+		}
+	}
+	spin_unlock(&anon_lock);
+	for (i=ctx.anon_region_cnt; i-- > cnt; )
+		if ((p = region_alloc(ctx.anon_region[i], len)))
+			return p;
+	return 0;
+}
+#endif
+
+static struct region *find_region(const void *p)
+{
+	if (ctx.region && (uintptr_t)p - (uintptr_t)ctx.region < ctx.region_len)
+		return ctx.region;
+#if USE_REGIONS
+	for (int i=ctx.anon_region_cnt; i--; )
+		if ((uintptr_t)p - (uintptr_t)ctx.anon_region[i] < REGION_SIZE)
+			return ctx.anon_region[i];
+#endif
+	return 0;
+}
+
+void *mem_map(size_t len)
+{
+	void *p;
+	if (ctx.region) {
+		if (!(p = region_alloc(ctx.region, len))) errno = ENOMEM;
+		return p ? p : MAP_FAILED;
+	}
+#if USE_REGIONS
+	if (len <= REGION_SIZE/16 && (p = anon_alloc(len)))
+		return p;
+#endif
+	return mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+}
+
+void mem_unmap(void *p, size_t len)
+{
+	struct region *r = find_region(p);
+	if (r) region_free(r, p, len);
+	else munmap(p, len);
+}
+
+void *mem_remap(void *p, size_t old_len, size_t new_len, int flags)
+{
+	struct region *r = find_region(p);
+	if (r) return region_remap(r, p, old_len, new_len);
+	return mremap(p, old_len, new_len, flags);
+}
+
+// pages of a shared mapping are only released by punching a hole
+// in the backing file.
+void mem_release(void *p, size_t len, int advice)
+{
+#ifdef MADV_REMOVE
+	if (ctx.region && find_region(p) == ctx.region) advice = MADV_REMOVE;
+#endif
+	madvise(p, len, advice);
+}
+
+int malloc_attach_region(int fd, void *addr, size_t len)
+{
+	// this may come before the heap is initialized.
+	size_t pagesize = get_page_size();
+	len &= -pagesize;
+	size_t pages = len / pagesize;
+	if (ctx.region || (uintptr_t)addr & (pagesize-1)
+	    || header_pages(pages, pagesize) >= pages) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct region *r = mmap(addr, len, PROT_READ|PROT_WRITE,
+		MAP_SHARED | (addr ? MAP_FIXED_NOREPLACE : 0), fd, 0);
+	if (r == MAP_FAILED) return -1;
+	if (addr && (void *)r != addr) {
+		munmap(r, len);
+		errno = EEXIST;
+		return -1;
+	}
+
+	// a fresh file is all zeros, so the lock is usable before the
+	// header is set up by whichever process gets there first.
+	spin_lock(&r->lock);
+	if (r->magic != REGION_MAGIC) {
+		init_region(r, pages, pagesize, 1);
+	} else if (r->pages != pages || r->pagesize != pagesize) {
+		spin_unlock(&r->lock);
+		munmap(r, len);
+		errno = EINVAL;
+		return -1;
+	}
+	spin_unlock(&r->lock);
+
+	wrlock();
+	ctx.region = r;
+	ctx.region_len = len;
+	unlock();
+	return 0;
+}
+
+void **malloc_region_root(void)
+{
+	if (!ctx.region) {
+		errno = EINVAL;
+		return 0;
+	}
+	return &ctx.region->root;
+}
+
+// this must not race with any process having the region attached,
+// including this one.
+int malloc_reset_region(int fd, size_t len)
+{
+	size_t pagesize = get_page_size();
+	len &= -pagesize;
+	size_t pages = len / pagesize, hdr = header_pages(pages, pagesize);
+	if (ctx.region) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (hdr >= pages) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct region *r = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED) return -1;
+	spin_lock(&r->lock);
+	init_region(r, pages, pagesize, 1);
+#ifdef MADV_REMOVE
+	madvise((unsigned char *)r + hdr*pagesize, len - hdr*pagesize, MADV_REMOVE);
+#endif
+	spin_unlock(&r->lock);
+	munmap(r, len);
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "meta.h"
+
+// touch every page of the group's slots so that first use doesn't
+// fault. the page holding the header is resident already. only bytes
+// of the group itself are touched, since the rest of a nested
+// group's pages are other slots of its parent, possibly in use by
+// other threads; the group isn't visible to any other thread yet.
+static void prefault(struct meta *g)
+{
+	unsigned char *p = g->mem->storage;
+	unsigned char *end = p + get_stride(g)*(g->last_idx+1);
+	for (p += -(uintptr_t)p & (PGSZ-1); p<end; p+=PGSZ)
+		*(volatile unsigned char *)p = *(volatile unsigned char *)p;
+}
+
+int malloc_reserve(size_t size, size_t count)
+{
+	if (size >= MMAP_THRESHOLD) {
+		errno = EINVAL;
+		return -1;
+	}
+	int sc = size_to_class(size);
+	size_t have = 0;
+	wrlock();
+	while (have < count) {
+		struct meta *g = alloc_group(sc, size);
+		if (!g) {
+			unlock();
+			errno = ENOMEM;
+			return -1;
+		}
+		// activate all slots up front so that allocating them
+		// never needs to, and keep the group through frees, even
+		// under memory pressure. only the head of the active list
+		// may have available slots; the rest start out freed.
+		g->mem->active_idx = g->last_idx;
+		g->avail_mask = 0;
+		g->freed_mask = (2ull<<g->last_idx)-1;
+		g->freeable = 0;
+		prefault(g);
+		queue(&ctx.active[sc], g);
+		if (ctx.active[sc] == g) activate_group(g);
+		have += g->last_idx+1;
+	}
+	unlock();
+	return 0;
+}
+
+int malloc_release(size_t size)
+{
+	if (size >= MMAP_THRESHOLD) {
+		errno = EINVAL;
+		return -1;
+	}
+	int sc = size_to_class(size);
+	wrlock();
+	for (struct meta_area *a = ctx.meta_area_head; a; a = a->next) {
+		for (int i=0; i<a->nslots; i++) {
+			struct meta *g = &a->slots[i];
+			if (!g->mem || g->sizeclass != sc || g->freeable
+			    || is_boot(g->mem))
+				continue;
+			g->freeable = 1;
+			uint64_t all = (2ull<<g->last_idx)-1;
+			if ((g->avail_mask | g->freed_mask) != all)
+				continue;
+			// a fully-free group goes now, the rest as their
+			// last slots are freed. this is a rare call, so
+			// unmapping under the lock is acceptable.
+			if (g->next) {
+				int activate_new = (ctx.active[sc]==g);
+				dequeue(&ctx.active[sc], g);
+				if (activate_new && ctx.active[sc])
+					activate_group(ctx.active[sc]);
+			}
+			struct mapinfo mi = free_group(g);
+			if (mi.len) mem_unmap(mi.base, mi.len);
+		}
+	}
+	unlock();
+	return 0;
+}
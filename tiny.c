@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "meta.h"
+
+#if USE_TINY
+
+// tiny groups are committed from the reserved region in chunks
+// of this size, mirroring the lazy unprotection of meta areas.
+#define TINY_COMMIT 65536
+
+static int init_tiny(void)
+{
+	size_t maplen = 2*TINY_REGION/TINY_GRANULE * sizeof(struct meta *);
+	unsigned char *p = mmap(0, 2*TINY_REGION, PROT_NONE,
+		MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	if (p==MAP_FAILED) return -1;
+	void *map = mmap(0, maplen, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	if (map==MAP_FAILED) {
+		munmap(p, 2*TINY_REGION);
+		return -1;
+	}
+	ctx.tiny_base = p;
+	ctx.tiny_map = map;
+	ctx.tiny_len = 2*TINY_REGION;
+	return 0;
+}
+
+static struct meta *alloc_tiny_group(int t)
+{
+	size_t len = TINY_GRANULE<<t;
+	if (!ctx.tiny_len && init_tiny()) return 0;
+	if (ctx.tiny_top[t] + len > TINY_REGION) return 0;
+	unsigned char *p = ctx.tiny_base + t*TINY_REGION + ctx.tiny_top[t];
+	if (ctx.tiny_top[t] + len > ctx.tiny_commit[t]) {
+		unsigned char *c = ctx.tiny_base + t*TINY_REGION + ctx.tiny_commit[t];
+		if (mprotect(c, TINY_COMMIT, PROT_READ|PROT_WRITE)
+		    && errno != ENOSYS)
+			return 0;
+		ctx.tiny_commit[t] += TINY_COMMIT;
+	}
+	struct meta *m = alloc_meta();
+	if (!m) return 0;
+	ctx.tiny_top[t] += len;
+
+	// there is no in-band group header; the map of granules
+	// in the region is the only way back to the meta record.
+	// tiny groups are never freed, only reused.
+	for (int i=0; i<1<<t; i++)
+		ctx.tiny_map[(p-ctx.tiny_base)/TINY_GRANULE + i] = m;
+	m->mem = (void *)p;
+	m->avail_mask = -1;
+	m->freed_mask = 0;
+	m->last_idx = 63;
+	m->freeable = 0;
+	m->sizeclass = TINY_CLASS+t;
+	m->maplen = 0;
+	return m;
+}
+
+static uint64_t try_avail_tiny(struct meta **pm)
+{
+	struct meta *m = *pm;
+	uint64_t mask, first;
+	if (!m) return 0;
+	mask = m->avail_mask;
+	if (!mask) {
+		if (!m->freed_mask) {
+			dequeue(pm, m);
+			m = *pm;
+			if (!m) return 0;
+		} else {
+			m = m->next;
+			*pm = m;
+		}
+		// all slots of a tiny group are active from the start.
+		do mask = m->freed_mask;
+		while (a_cas_64(&m->freed_mask, mask, 0)!=mask);
+		assert(mask);
+	}
+	first = mask&-mask;
+	m->avail_mask = mask-first;
+	return first;
+}
+
+void *alloc_tiny(size_t n)
+{
+	int t = n > 8;
+	struct meta *g;
+	uint64_t mask, first;
+
+	rdlock();
+	g = ctx.tiny_active[t];
+	for (;;) {
+		mask = g ? g->avail_mask : 0;
+		first = mask&-mask;
+		if (!first) break;
+		if (RDLOCK_IS_EXCLUSIVE || !MT)
+			g->avail_mask = mask-first;
+		else if (a_cas_64(&g->avail_mask, mask, mask-first)!=mask)
+			continue;
+		goto success;
+	}
+	upgradelock();
+
+	first = try_avail_tiny(&ctx.tiny_active[t]);
+	if (!first) {
+		g = alloc_tiny_group(t);
+		if (!g) {
+			unlock();
+			return 0;
+		}
+		first = 1;
+		g->avail_mask--;
+		queue(&ctx.tiny_active[t], g);
+	}
+	g = ctx.tiny_active[t];
+
+success:
+	unlock();
+	return (unsigned char *)g->mem + (a_ctz_64(first) << (3+t));
+}
+
+void free_tiny(void *p)
+{
+	struct meta *g = get_tiny_meta(p);
+	int t = g->sizeclass - TINY_CLASS;
+	int idx = ((unsigned char *)p - (unsigned char *)g->mem) >> (3+t);
+	uint64_t self = 1ull<<idx;
+
+	// atomic free without locking unless the group was full
+	// and might need to be put back on the active list.
+	for (;;) {
+		uint64_t freed = g->freed_mask;
+		if (!freed) break;
+		if (!MT)
+			g->freed_mask = freed+self;
+		else if (a_cas_64(&g->freed_mask, freed, freed+self)!=freed)
+			continue;
+		return;
+	}
+
+	wrlock();
+	if (!(g->freed_mask | g->avail_mask) && ctx.tiny_active[t] != g)
+		queue(&ctx.tiny_active[t], g);
+	a_or_64(&g->freed_mask, self);
+	unlock();
+}
+
+#endif
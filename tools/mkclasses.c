@@ -0,0 +1,170 @@
+// generate a size class table tuned to an allocation size histogram.
+//
+// usage: mkclasses [-p prior] < histogram > classes.h
+//
+// input lines are "size [count]" in bytes, a count of 1 being
+// assumed if omitted, so a plain trace of request sizes works as
+// well as a histogram. lines not starting with a digit are ignored.
+//
+// size_to_class() finds a class by looking at the quad of classes
+// selected by the request's power of two, so the top class of each
+// quad must stay at 2^k-1 units, and the classes below 10 units are
+// looked up directly. only the remaining classes are chosen here,
+// per quad, minimizing the slack between requests and the class
+// they land in. a fraction (the prior, default 0.1) of each quad's
+// weight is spread evenly over its range so that sizes absent from
+// the profile are not left with huge slack. quads with no profiled
+// requests keep the default classes.
+//
+// for each class the slot count is chosen so that a group is just
+// below a power of two, as with the default table, falling back to
+// other even counts for class sizes that fit badly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNIT 16
+#define IB 4
+#define NCLASSES 48
+#define MAXUNITS 8191
+
+static const unsigned short default_classes[NCLASSES] = {
+	1, 2, 3, 4, 5, 6, 7, 8,
+	9, 10, 12, 15,
+	18, 20, 25, 31,
+	36, 42, 50, 63,
+	72, 84, 102, 127,
+	146, 170, 204, 255,
+	292, 340, 409, 511,
+	584, 682, 818, 1023,
+	1169, 1364, 1637, 2047,
+	2340, 2730, 3276, 4095,
+	4680, 5460, 6552, 8191,
+};
+
+static double hist[MAXUNITS+1];
+static unsigned short classes[NCLASSES];
+
+// choose m increasing class sizes in [lo,top-1], with lo-1 and top
+// being fixed classes, minimizing sum of w[u]*(class(u)-u).
+static void fit(int lo, int top, int m, unsigned short *out, double prior)
+{
+	int n = top-lo+1;
+	double mass = 0;
+	for (int u=lo; u<=top; u++) mass += hist[u];
+	if (!mass) return;
+
+	double *w = calloc(n+1, sizeof *w);
+	double *wu = calloc(n+1, sizeof *wu);
+	double *f = malloc(m*(n+1)*sizeof *f);
+	int *from = malloc(m*(n+1)*sizeof *from);
+	if (!w || !wu || !f || !from) {
+		perror("mkclasses");
+		exit(1);
+	}
+
+	// prefix sums by position v = u-lo+1, position 0 being lo-1.
+	for (int v=1; v<=n; v++) {
+		double x = hist[lo+v-1] + prior*mass/n;
+		w[v] = w[v-1] + x;
+		wu[v] = wu[v-1] + x*v;
+	}
+#define COST(a,b) ((b)*(w[b]-w[a]) - (wu[b]-wu[a]))
+#define F(j,v) f[(j)*(n+1)+(v)]
+#define FROM(j,v) from[(j)*(n+1)+(v)]
+
+	for (int v=1; v<n; v++) F(0,v) = COST(0,v), FROM(0,v) = 0;
+	for (int j=1; j<m; j++) {
+		for (int v=j+1; v<n; v++) {
+			F(j,v) = -1;
+			for (int a=j; a<v; a++) {
+				double c = F(j-1,a) + COST(a,v);
+				if (F(j,v) < 0 || c < F(j,v))
+					F(j,v) = c, FROM(j,v) = a;
+			}
+		}
+	}
+	double best = -1;
+	int v = 0;
+	for (int a=m; a<n; a++) {
+		double c = F(m-1,a) + COST(a,n);
+		if (best < 0 || c < best) best = c, v = a;
+	}
+	for (int j=m-1; j>=0; j--) {
+		out[j] = lo+v-1;
+		v = FROM(j,v);
+	}
+	free(w);
+	free(wu);
+	free(f);
+	free(from);
+}
+
+static double fill(int size, int cnt)
+{
+	size_t span = (size_t)size*UNIT*cnt + UNIT, p = 1;
+	while (p < span) p *= 2;
+	return (double)span/p;
+}
+
+// slot count that best fills a power of two: a multiple of 4 from 16
+// to 32, like the default table, unless none reaches 90%, in which
+// case any even count up to 62. larger counts win when within 1% of
+// the best fill.
+static int med_cnt(int size)
+{
+	int lo = 16, hi = 32, step = 4;
+	for (;;) {
+		double best = 0;
+		for (int cnt=lo; cnt<=hi; cnt+=step)
+			if (fill(size, cnt) > best) best = fill(size, cnt);
+		if (best >= 0.9 || step == 2) {
+			for (int cnt=hi; ; cnt-=step)
+				if (fill(size, cnt) >= best-0.01) return cnt;
+		}
+		lo = 8, hi = 62, step = 2;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double prior = 0.1;
+	char buf[256];
+
+	if (argc == 3 && !strcmp(argv[1], "-p")) {
+		prior = atof(argv[2]);
+	} else if (argc != 1) {
+		fprintf(stderr, "usage: %s [-p prior] < histogram\n", argv[0]);
+		return 1;
+	}
+
+	while (fgets(buf, sizeof buf, stdin)) {
+		char *s;
+		if (*buf<'0' || *buf>'9') continue;
+		unsigned long long size = strtoull(buf, &s, 10);
+		double cnt = strtod(s, &s);
+		if (s == buf || cnt <= 0) cnt = 1;
+		if (size+IB > (unsigned long long)MAXUNITS*UNIT) continue;
+		hist[size ? (size+IB-1)/UNIT+1 : 1] += cnt;
+	}
+
+	memcpy(classes, default_classes, sizeof classes);
+	// the quad at index 8 has only index 10 free.
+	fit(11, 15, 1, classes+10, prior);
+	for (int i=12; i<NCLASSES; i+=4)
+		fit(classes[i-1]+1, classes[i+3], 3, classes+i, prior);
+
+	printf("// generated by tools/mkclasses; do not edit.\n\n");
+	printf("const uint16_t size_classes[] = {\n");
+	for (int i=0; i<NCLASSES; i++)
+		printf("%s%d,%s", (i<8 ? i : i%4) ? " " : "\t",
+			classes[i], (i<8 ? i==7 : i%4==3) ? "\n" : "");
+	printf("};\n\n");
+	printf("static const uint8_t med_cnt_tab[%d] = {\n", NCLASSES);
+	for (int i=0; i<NCLASSES; i++)
+		printf("%s%d,%s", i%8 ? " " : "\t", i<9 ? 0 : med_cnt(classes[i]),
+			i%8==7 ? "\n" : "");
+	printf("};\n");
+	return 0;
+}